@@ -1,9 +1,13 @@
 #include "aartfaac2ms.h"
 
 #include "aartfaacms.h"
+#include "asyncreader.h"
 #include "averagingwriter.h"
 #include "fitswriter.h"
 #include "mswriter.h"
+#include "partfilename.h"
+#include "rawwriter.h"
+#include "shardedwriter.h"
 #include "threadedwriter.h"
 #include "version.h"
 
@@ -17,9 +21,14 @@
 #include <casacore/measures/Measures/MPosition.h>
 #include <casacore/measures/Measures/Muvw.h>
 
+#include <algorithm>
+#include <cmath>
 #include <complex>
 #include <iostream>
 #include <fstream>
+#include <future>
+#include <limits>
+#include <thread>
 
 #include <unistd.h>
 
@@ -31,17 +40,30 @@
 
 using namespace aoflagger;
 
+constexpr size_t Aartfaac2ms::notSelected;
+
 Aartfaac2ms::Aartfaac2ms() :
+	_reader(nullptr),
 	_flagger(),
 	_statistics(),
 	_mode(AartfaacMode::Unused),
 	_outputFormat(MSOutputFormat),
+	_polarizationMode(Writer::LinearPolarizations),
 	_rfiDetection(false),
 	_collectStatistics(true),
 	_collectHistograms(false),
 	_timeAvgFactor(1), _freqAvgFactor(1),
+	_maxDecorrelation(0.0),
+	_earlyAveraging(false),
+	_timeGridPhase(0),
 	_memPercentage(50),
 	_intervalStart(0), _intervalEnd(0),
+	_followChunkSize(0), _followTimeout(0.0),
+	_directIO(false),
+	_asyncReadDepth(0),
+	_channelStart(0), _channelEnd(0), _channelStep(1),
+	_minBaselineLength(0.0), _maxBaselineLength(0.0),
+	_detectBadAntennas(false), _omitBadAntennas(false),
 	_manualPhaseCentre(false),
 	_manualPhaseCentreRA(0.0),
 	_manualPhaseCentreDec(0.0),
@@ -52,8 +74,11 @@ Aartfaac2ms::Aartfaac2ms() :
 	_dyscoNormalization("AF"),
 	_dyscoDistTruncation(2.5),
 	_threadCount(1),
+	_shardCount(1),
 	_outputData(empty_aligned<std::complex<float>>()),
-	_outputWeights(empty_aligned<float>())
+	_outputWeights(empty_aligned<float>()),
+	_reducedData(empty_aligned<std::complex<float>>()),
+	_reducedWeights(empty_aligned<float>())
 {
 }
 
@@ -72,10 +97,9 @@ void Aartfaac2ms::allocateBuffers()
 		memSize = int64_t(memLimit * (1024.0*1024.0*1024.0));
 		memPercentage = 100.0;
 	}
-	size_t nChannelSpace = ((((_reader->NChannels()-1)/4)+1)*4);
+	size_t nChannelSpace = ((((nChannels()-1)/4)+1)*4);
 	size_t maxSamples = memSize*memPercentage/(100*(sizeof(float)*2+1));
-	size_t nAntennas = _reader->NAntennas();
-	size_t maxScansPerPart = maxSamples / (4*nChannelSpace*(nAntennas+1)*nAntennas/2);
+	size_t maxScansPerPart = maxSamples / (4*nChannelSpace*_baselines.size());
 	std::cout << "Timesteps that fit in memory: " << maxScansPerPart << '\n';
 	if(maxScansPerPart<1)
 	{
@@ -85,49 +109,96 @@ void Aartfaac2ms::allocateBuffers()
 	{
 		std::cout << "WARNING! This computer does not have enough memory for accurate flagging; expect non-optimal flagging accuracy.\n"; 
 	}
-	size_t nTimesteps = NTimestepsSelected();
-	_nParts = 1 + nTimesteps / maxScansPerPart;
-	if(_nParts == 1)
-		std::cout << "All " << nTimesteps << " scans fit in memory; no partitioning necessary.\n";
-	else
-		std::cout << "Observation does not fit fully in memory, will partition data in " << _nParts << " chunks of " << (nTimesteps/_nParts) << " scans.\n";
+	size_t requiredWidthCapacity = 0;
+	if(isFollowing())
+	{
+		// The number of chunks is not known in advance
+		_nParts = 0;
+		requiredWidthCapacity = _followChunkSize;
+		std::cout << "Following input, will process data in chunks of " << _followChunkSize << " scans.\n";
+		if(_followChunkSize > maxScansPerPart)
+			std::cout << "WARNING! Chunks of this size do not fit in the given amount of memory.\n";
+	}
+	else {
+		size_t nTimesteps = NTimestepsSelected();
+		_nParts = 1 + nTimesteps / maxScansPerPart;
+		if(_nParts == 1)
+			std::cout << "All " << nTimesteps << " scans fit in memory; no partitioning necessary.\n";
+		else
+			std::cout << "Observation does not fit fully in memory, will partition data in " << _nParts << " chunks of " << (nTimesteps/_nParts) << " scans.\n";
+		
+		for(size_t chunkIndex=0; chunkIndex!=_nParts; ++chunkIndex)
+			requiredWidthCapacity = std::max(requiredWidthCapacity, chunkStart(chunkIndex+1) - chunkStart(chunkIndex));
+	}
+	for(size_t i=0; i!=_baselines.size(); ++i)
+		_imageSetBuffers.emplace_back(_flagger.MakeImageSet(requiredWidthCapacity, nChannels(), 8, 0.0f, requiredWidthCapacity));
 	
-	const size_t requiredWidthCapacity = (nTimesteps+_nParts-1)/_nParts;
-	for(size_t antenna1=0;antenna1!=_reader->NAntennas();++antenna1)
+	if(useEarlyAveraging())
 	{
-		for(size_t antenna2=antenna1; antenna2!=_reader->NAntennas(); ++antenna2)
-		{
-			_imageSetBuffers.emplace_back(_flagger.MakeImageSet(requiredWidthCapacity, _reader->NChannels(), 8, 0.0f, requiredWidthCapacity));
-		}
+		// A chunk can start and end with a partial interval
+		const size_t maxIntervals = (requiredWidthCapacity + _timeAvgFactor - 1) / _timeAvgFactor + 1;
+		_averagedWeightsStride = maxIntervals * (nChannels() / _freqAvgFactor);
+		_averagedWeights.resize(_averagedWeightsStride * _imageSetBuffers.size());
 	}
 }
 
-void Aartfaac2ms::initializeWriter(const char* outputFilename)
+std::unique_ptr<Writer> Aartfaac2ms::makeOutputWriter(const std::string& outputFilename)
 {
 	switch(_outputFormat)
 	{
 		case FitsOutputFormat:
-			_writer.reset(new ThreadedWriter(std::unique_ptr<Writer>(new FitsWriter(outputFilename))));
-			break;
+			return std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<Writer>(new FitsWriter(outputFilename))));
 		case MSOutputFormat: {
 			std::unique_ptr<MSWriter> msWriter(new MSWriter(outputFilename));
 			if(_useDysco)
 				msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
-			_writer.reset(new ThreadedWriter(std::move(msWriter)));
-		} break;
+			return std::unique_ptr<Writer>(new ThreadedWriter(std::move(msWriter)));
+		}
+		case RawOutputFormat:
+			return std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<Writer>(new RawWriter(outputFilename))));
+	}
+	throw std::runtime_error("Invalid output format");
+}
+
+void Aartfaac2ms::initializeWriter(const char* outputFilename)
+{
+	if(_shardCount > 1)
+	{
+		std::vector<std::unique_ptr<Writer>> shards;
+		for(size_t i=0; i!=_shardCount; ++i)
+			shards.emplace_back(makeOutputWriter(PartFilename(outputFilename, i)));
+		_writer.reset(new ShardedWriter(std::move(shards)));
+	}
+	else {
+		_writer = makeOutputWriter(outputFilename);
 	}
 	
-	if(_freqAvgFactor != 1 || _timeAvgFactor != 1)
+	if((_freqAvgFactor != 1 || _timeAvgFactor != 1) && !useEarlyAveraging())
 	{
-		_writer.reset(new ThreadedWriter(std::unique_ptr<Writer>(new AveragingWriter(std::move(_writer), _timeAvgFactor, _freqAvgFactor))));
+		std::unique_ptr<AveragingWriter> averagingWriter(new AveragingWriter(std::move(_writer), _timeAvgFactor, _freqAvgFactor));
+		averagingWriter->SetThreadCount(_threadCount);
+		averagingWriter->SetTimeGrid(firstSelectedTime(), _reader->IntegrationTime());
+		if(_maxDecorrelation != 0.0)
+			averagingWriter->SetBaselineDependentAveraging(_maxDecorrelation, _reader->IntegrationTime());
+		_writer.reset(new ThreadedWriter(std::move(averagingWriter)));
 	}
 	
 	setAntennas();
+	_writer->WritePolarizations(_polarizationMode, false);
 	setSPWs();
 	setSource();
 	setField();
-	_writer->WritePolarizationForLinearPols(false);
 	setObservation();
+	
+	const size_t nAntennas = _reader->NAntennas();
+	if(_baselines.size() != nAntennas * (nAntennas + 1) / 2)
+		_writer->SetBaselineSelection(_baselines);
+	// When following, the number of rows is not known in advance
+	if(!isFollowing())
+	{
+		const size_t nTimesteps = useEarlyAveraging() ? nTimeIntervals() : NTimestepsSelected();
+		_writer->ReserveRows(_baselines.size() * nTimesteps);
+	}
 }
 
 void Aartfaac2ms::setAntennas()
@@ -150,25 +221,65 @@ void Aartfaac2ms::setAntennas()
 
 void Aartfaac2ms::setSPWs()
 {
-	std::vector<MSWriter::ChannelInfo> channels(_reader->NChannels());
-	_channelFrequenciesHz.resize(_reader->NChannels());
+	std::vector<MSWriter::ChannelInfo> channels(nChannels());
+	_channelFrequenciesHz.resize(nChannels());
 	std::ostringstream str;
 	str << "AARTF_BAND_" << (round(1e-6*_reader->Frequency()*10.0)/10.0);
-	const double chWidth = _reader->Bandwidth() / _reader->NChannels();
-	double startFrequency = _reader->Frequency() - _reader->Bandwidth()*0.5;
-	for(size_t ch=0; ch!=channels.size(); ++ch)
+	for(size_t subband=0; subband!=_readers.size(); ++subband)
+	{
+		const double chWidth = _readers[subband]->ChannelWidth();
+		for(size_t ch=0; ch!=_readers[subband]->NChannels(); ++ch)
+		{
+			const size_t index = _subbandChannelOffsets[subband] + ch;
+			_channelFrequenciesHz[index] = _readers[subband]->ChannelFrequency(ch);
+			MSWriter::ChannelInfo& channel = channels[index];
+			channel.chanFreq = _channelFrequenciesHz[index];
+			channel.chanWidth = chWidth;
+			channel.effectiveBW = chWidth;
+			channel.resolution = chWidth;
+		}
+	}
+	// The band covers the edges of the outer channels. Channels in between
+	// can be missing, e.g. when the subbands are not adjacent or when only
+	// every n-th channel is selected.
+	double lowEdge = channels.front().chanFreq - 0.5 * channels.front().chanWidth;
+	double highEdge = channels.front().chanFreq + 0.5 * channels.front().chanWidth;
+	for(const MSWriter::ChannelInfo& channel : channels)
+	{
+		lowEdge = std::min(lowEdge, channel.chanFreq - 0.5 * channel.chanWidth);
+		highEdge = std::max(highEdge, channel.chanFreq + 0.5 * channel.chanWidth);
+	}
+	if(useEarlyAveraging())
 	{
-		MSWriter::ChannelInfo& channel = channels[ch];
-		_channelFrequenciesHz[ch] = startFrequency + chWidth*(0.5+double(ch));
-		channel.chanFreq = _channelFrequenciesHz[ch];
-		channel.chanWidth = chWidth;
-		channel.effectiveBW = chWidth;
-		channel.resolution = chWidth;
+		// Same channel averaging as done by the AveragingWriter
+		if(channels.size()%_freqAvgFactor != 0)
+			std::cout << " Warning: channels averaging factor is not a multiply of total number of channels. Last channel(s) will be left out.\n";
+		std::vector<MSWriter::ChannelInfo> avgChannels(channels.size() / _freqAvgFactor);
+		_averagedChannelFrequenciesHz.resize(avgChannels.size());
+		for(size_t ch=0; ch!=avgChannels.size(); ++ch)
+		{
+			MSWriter::ChannelInfo& channel = avgChannels[ch];
+			channel.chanFreq = 0.0;
+			channel.chanWidth = 0.0;
+			channel.effectiveBW = 0.0;
+			channel.resolution = 0.0;
+			for(size_t i=0; i!=_freqAvgFactor; ++i)
+			{
+				const MSWriter::ChannelInfo& curChannel = channels[ch*_freqAvgFactor + i];
+				channel.chanFreq += curChannel.chanFreq;
+				channel.chanWidth += curChannel.chanWidth;
+				channel.effectiveBW += curChannel.effectiveBW;
+				channel.resolution += curChannel.resolution;
+			}
+			channel.chanFreq /= (double) _freqAvgFactor;
+			_averagedChannelFrequenciesHz[ch] = channel.chanFreq;
+		}
+		channels = std::move(avgChannels);
 	}
 	_writer->WriteBandInfo(str.str(),
 		channels,
-		_reader->Frequency(),
-		_reader->Bandwidth(),
+		0.5 * (lowEdge + highEdge),
+		highEdge - lowEdge,
 		false
 	);
 }
@@ -264,107 +375,227 @@ void Aartfaac2ms::processBaseline(size_t baselineIndex, Strategy& threadStrategy
 	FlagMask& flagMask = _flagBuffers[baselineIndex];
 	const std::pair<size_t, size_t>& baseline = _baselines[baselineIndex];
 	
-	if(_rfiDetection && (baseline.first != baseline.second))
+	if(_isBadAntenna[baseline.first] || _isBadAntenna[baseline.second])
+		flagMask = _flagger.MakeFlagMask(_timestepsStart.size(), _channelFrequenciesHz.size(), true);
+	else if(_rfiDetection && (baseline.first != baseline.second))
 		flagMask = threadStrategy.Run(imageSet);
 	else
 		flagMask = _flagger.MakeFlagMask(_timestepsStart.size(), _channelFrequenciesHz.size(), false);
+	for(size_t t : _corruptTimesteps)
+	{
+		for(size_t ch=0; ch!=_channelFrequenciesHz.size(); ++ch)
+			flagMask.Buffer()[ch * flagMask.HorizontalStride() + t] = true;
+	}
 
 	threadStatistics.CollectStatistics(imageSet, flagMask, _correlatorMask, baseline.first, baseline.second);
+	
+	if(useEarlyAveraging())
+		averageBaseline(baselineIndex);
 }
 
-void Aartfaac2ms::Run(const char* inputFilename, const char* outputFilename, const char* antennaConfFilename, AartfaacMode mode)
+void Aartfaac2ms::averageBaseline(size_t baselineIndex)
 {
+	// The averaged values are stored at the start of the image and flag
+	// buffers, i.e. averaged sample (t, ch) is stored at (t, ch). Since
+	// the averaging interval of a sample never contains earlier sample
+	// positions, this does not overwrite data that is still needed.
+	// Intervals are given by _intervalBoundaries, so that the first and
+	// last interval of a chunk may be partial.
+	ImageSet& imageSet = _imageSetBuffers[baselineIndex];
+	FlagMask& flagMask = _flagBuffers[baselineIndex];
+	const size_t
+		stride = imageSet.HorizontalStride(),
+		flagStride = flagMask.HorizontalStride(),
+		nOutTimesteps = _intervalBoundaries.size() - 1,
+		nOutChannels = _averagedChannelFrequenciesHz.size();
+	bool* flags = flagMask.Buffer();
+	float* weights = &_averagedWeights[baselineIndex * _averagedWeightsStride];
+	
+	// The weight of an averaged sample is the sum of the weights of the
+	// unflagged samples
+	for(size_t ch=0; ch!=nOutChannels; ++ch)
+	{
+		for(size_t t=0; t!=nOutTimesteps; ++t)
+		{
+			const size_t start = _intervalBoundaries[t], end = _intervalBoundaries[t+1];
+			float weightSum = 0.0;
+			for(size_t i=0; i!=_freqAvgFactor; ++i)
+			{
+				const bool* flagPtr = &flags[(ch*_freqAvgFactor + i)*flagStride];
+				for(size_t j=start; j!=end; ++j)
+				{
+					if(!flagPtr[j])
+						weightSum += _timestepWeights[j];
+				}
+			}
+			weights[ch*nOutTimesteps + t] = weightSum;
+		}
+	}
+	
+	// Weighted average of the unflagged samples, or if all samples are
+	// flagged, the plain average of all samples
+	for(size_t image=0; image!=8; ++image)
+	{
+		float* values = imageSet.ImageBuffer(image);
+		for(size_t ch=0; ch!=nOutChannels; ++ch)
+		{
+			for(size_t t=0; t!=nOutTimesteps; ++t)
+			{
+				const size_t start = _intervalBoundaries[t], end = _intervalBoundaries[t+1];
+				float sum = 0.0, allSum = 0.0;
+				for(size_t i=0; i!=_freqAvgFactor; ++i)
+				{
+					const size_t y = ch*_freqAvgFactor + i;
+					const float* valuePtr = &values[y*stride];
+					const bool* flagPtr = &flags[y*flagStride];
+					for(size_t j=start; j!=end; ++j)
+					{
+						allSum += valuePtr[j];
+						if(!flagPtr[j])
+							sum += valuePtr[j] * _timestepWeights[j];
+					}
+				}
+				const float weight = weights[ch*nOutTimesteps + t];
+				values[ch*stride + t] = (weight == 0.0) ? allSum / ((end-start) * _freqAvgFactor) : sum / weight;
+			}
+		}
+	}
+	
+	for(size_t ch=0; ch!=nOutChannels; ++ch)
+	{
+		for(size_t t=0; t!=nOutTimesteps; ++t)
+			flags[ch*flagStride + t] = weights[ch*nOutTimesteps + t] == 0.0;
+	}
+}
+
+void Aartfaac2ms::Run(const std::vector<std::string>& inputFilenames, const char* outputFilename, const char* antennaConfFilename, AartfaacMode mode)
+{
+	if(isFollowing() && _outputFormat != MSOutputFormat)
+		throw std::runtime_error("Following the input is only supported for measurement set output");
+	// The asynchronous readers do not use direct I/O, which requires aligned reads
+	if(_directIO && _asyncReadDepth != 0)
+		throw std::runtime_error("Direct I/O can not be combined with asynchronous reading");
 	_mode = mode;
-	_reader.reset(new AartfaacFile(inputFilename, mode));
+	_readers.clear();
+	for(const std::string& inputFilename : inputFilenames)
+	{
+		_readers.emplace_back(new AartfaacFile(inputFilename.c_str(), mode));
+		_readers.back()->SetChannelSelection(_channelStart, _channelEnd, _channelStep);
+		if(_directIO && !_readers.back()->EnableDirectIO())
+			std::cout << "WARNING: Direct I/O is not supported for " << inputFilename << "; using normal reads.\n";
+	}
+	// Subbands are written as one band with the channels in order of frequency
+	std::sort(_readers.begin(), _readers.end(),
+		[](const std::unique_ptr<AartfaacFile>& a, const std::unique_ptr<AartfaacFile>& b)
+		{ return a->Frequency() < b->Frequency(); });
+	_reader = _readers.front().get();
+	_subbandChannelOffsets.assign(1, 0);
+	for(const std::unique_ptr<AartfaacFile>& reader : _readers)
+	{
+		if(reader->NAntennas() != _reader->NAntennas() ||
+			reader->NChannelsInFile() != _reader->NChannelsInFile() ||
+			reader->IntegrationTime() != _reader->IntegrationTime() ||
+			std::fabs(reader->StartTime() - _reader->StartTime()) > 0.5 * _reader->IntegrationTime())
+			throw std::runtime_error("All subband files should have the same antennas, channels and timesteps");
+		_subbandChannelOffsets.emplace_back(_subbandChannelOffsets.back() + reader->NChannels());
+	}
+	if(_shardCount > _reader->NAntennas())
+		throw std::runtime_error("Number of shards can not be larger than the number of antennas");
+	if(_readers.size() > 1)
+		std::cout << "Combining " << _readers.size() << " subbands into " << nChannels() << " channels.\n";
+	if(_reader->NChannels() != _reader->NChannelsInFile())
+		std::cout << "Selected " << _reader->NChannels() << " of " << _reader->NChannelsInFile() << " channels per subband.\n";
+	
+	// Averaging intervals are aligned to whole intervals since the time zero
+	// point, as is done by the AveragingWriter
+	_timeGridPhase = size_t(std::round(firstSelectedTime() / _reader->IntegrationTime())) % _timeAvgFactor;
+	if(isFollowing() && useEarlyAveraging())
+		_followChunkSize = (_followChunkSize + _timeAvgFactor - 1) / _timeAvgFactor * _timeAvgFactor;
+	_nTimestepsAvailable = 0;
+	_lastGrowthTime = std::chrono::steady_clock::now();
 	
 	readAntennaPositions(antennaConfFilename);
 	
+	_isBadAntenna.assign(_reader->NAntennas(), false);
+	if(_detectBadAntennas)
+		detectBadAntennas();
+	
+	selectBaselines();
+	
 	if(_rfiDetection)
 		_strategyFile = _flagger.FindStrategyFile(aoflagger::TelescopeId::AARTFAAC_TELESCOPE);
 	
-	aocommon::UVector<std::complex<float>> vis(_reader->VisPerTimestep());
-	size_t index = 0;
-	
 	allocateBuffers();
 	
 	initializeWriter(outputFilename);
 	
-	_reader->SeekToTimestep(_intervalStart);
+	for(std::unique_ptr<AartfaacFile>& reader : _readers)
+		reader->SeekToTimestep(_intervalStart);
 	
-	aocommon::UVector<size_t> baselineMap(_reader->NAntennas()*_reader->NAntennas());
-	size_t bIndex = 0;
-	for(size_t antenna1=0; antenna1!=_reader->NAntennas(); ++antenna1)
-	{
-		for(size_t antenna2=antenna1; antenna2!=_reader->NAntennas(); ++antenna2)
-		{
-			baselineMap[antenna2 + antenna1*_reader->NAntennas()] = bIndex;
-			++bIndex;
-		}
-	}
+	// Maps antenna pairs to their index in _baselines, or to notSelected
+	aocommon::UVector<size_t> baselineMap(_reader->NAntennas()*_reader->NAntennas(), notSelected);
+	for(size_t bIndex=0; bIndex!=_baselines.size(); ++bIndex)
+		baselineMap[_baselines[bIndex].second + _baselines[bIndex].first*_reader->NAntennas()] = bIndex;
 
-	for(size_t chunkIndex = 0; chunkIndex != _nParts; ++chunkIndex)
+	size_t chunkStart, chunkEnd;
+	for(size_t chunkIndex = 0; nextChunk(chunkIndex, chunkStart, chunkEnd); ++chunkIndex)
 	{
-		std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << _nParts << " ===\n";
+		if(chunkStart == chunkEnd)
+			continue;
+		if(isFollowing())
+			std::cout << "=== Processing chunk " << (chunkIndex+1) << " (scans " << chunkStart << "-" << chunkEnd << ") ===\n";
+		else
+			std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << _nParts << " ===\n";
 		
-		size_t nTimesteps = NTimestepsSelected();
-		size_t chunkStart = nTimesteps*chunkIndex/_nParts + _intervalStart;
-		size_t chunkEnd = nTimesteps*(chunkIndex+1)/_nParts + _intervalStart;
+		if(useEarlyAveraging())
+		{
+			_intervalBoundaries.clear();
+			for(size_t t=0; t!=chunkEnd-chunkStart; ++t)
+			{
+				if(t == 0 || (chunkStart - _intervalStart + t + _timeGridPhase) % _timeAvgFactor == 0)
+					_intervalBoundaries.emplace_back(t);
+			}
+			_intervalBoundaries.emplace_back(chunkEnd-chunkStart);
+		}
 		for(ImageSet& imageSet : _imageSetBuffers)
 			imageSet.ResizeWithoutReallocation(chunkEnd-chunkStart);
 		
-		_correlatorMask = _flagger.MakeFlagMask(chunkEnd-chunkStart, _reader->NChannels(), false);
+		_correlatorMask = _flagger.MakeFlagMask(chunkEnd-chunkStart, nChannels(), false);
 		
 		_readWatch.Start();
 		_timestepsStart.clear();
 		_timestepsEnd.clear();
+		_corruptTimesteps.clear();
 		ProgressBar progress("Reading");
-		for(size_t timeIndex=chunkStart; timeIndex!=chunkEnd; ++timeIndex)
+		// Subbands are read concurrently, each into its own range of channels
+		std::vector<std::future<void>> subbandReads;
+		for(size_t subband=1; subband!=_readers.size(); ++subband)
+			subbandReads.emplace_back(std::async(std::launch::async, &Aartfaac2ms::readSubband, this, subband, chunkStart, chunkEnd, std::cref(baselineMap), nullptr));
+		readSubband(0, chunkStart, chunkEnd, baselineMap, &progress);
+		for(std::future<void>& subbandRead : subbandReads)
+			subbandRead.get();
+		// Corrupt timesteps of any subband are flagged in all channels
+		std::sort(_corruptTimesteps.begin(), _corruptTimesteps.end());
+		_corruptTimesteps.erase(std::unique(_corruptTimesteps.begin(), _corruptTimesteps.end()), _corruptTimesteps.end());
+		for(size_t t : _corruptTimesteps)
 		{
-			progress.SetProgress(timeIndex-chunkStart, chunkEnd-chunkStart);
-			
-			Timestep step = _reader->ReadTimestep(vis.data());
-			_timestepsStart.emplace_back(step.startTime);
-			_timestepsEnd.emplace_back(step.endTime);
-			
-			size_t bufferIndex = timeIndex-chunkStart;
-			std::complex<float>* visPtr = vis.data();
-			for(size_t antenna1=0; antenna1!=_reader->NAntennas(); ++antenna1)
-			{
-				for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
-				{
-					size_t bIndex = baselineMap[antenna1 + antenna2*_reader->NAntennas()];
-					ImageSet& imageSet = _imageSetBuffers[bIndex];
-					for(size_t ch=0; ch!=_reader->NChannels(); ++ch)
-					{
-						for(size_t p=0; p!=4; ++p)
-						{
-							float
-								*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
-								*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
-							realPtr[ch*imageSet.HorizontalStride()] = visPtr->real();
-							imagPtr[ch*imageSet.HorizontalStride()] = visPtr->imag();
-							++visPtr;
-						}
-					}
-				}
-			}
-		}	
-		++index;
+			for(size_t ch=0; ch!=nChannels(); ++ch)
+				_correlatorMask.Buffer()[ch * _correlatorMask.HorizontalStride() + t] = true;
+		}
+		if(!_corruptTimesteps.empty())
+			std::cout << "Flagged " << _corruptTimesteps.size() << " corrupt or missing timesteps.\n";
 		_readWatch.Pause();
 		
+		// Weights are normalized as in initializeWeights()
+		_timestepWeights.resize(chunkEnd-chunkStart);
+		for(size_t i=0; i!=_timestepWeights.size(); ++i)
+			_timestepWeights[i] = (_timestepsEnd[i] - _timestepsStart[i]) * _reader->ChannelWidth();
+		
 		progress = ProgressBar("Processing baselines");
 		_processWatch.Start();
 		
 		_flagBuffers.clear();
-		_baselines.clear();
-		for(size_t antenna1=0;antenna1!=_reader->NAntennas();++antenna1)
-		{
-			for(size_t antenna2=antenna1; antenna2!=_reader->NAntennas(); ++antenna2)
-			{
-				_flagBuffers.emplace_back();
-				_baselines.emplace_back(antenna1, antenna2);
-			}
-		}
+		_flagBuffers.resize(_baselines.size());
 		
 		_baselinesToProcess.resize(_threadCount);
 		std::vector<std::thread> threadGroup;
@@ -379,13 +610,39 @@ void Aartfaac2ms::Run(const char* inputFilename, const char* outputFilename, con
 		_processWatch.Pause();
 		progress = ProgressBar("Writing");
 		_writeWatch.Start();
-		_outputFlags.resize(_reader->NChannels()*4);
-		_outputData = make_aligned<std::complex<float>>(_reader->NChannels()*4, 16);
-		_outputWeights = make_aligned<float>(_reader->NChannels()*4, 16);
-		for(size_t timeIndex=chunkStart; timeIndex!=chunkEnd; ++timeIndex)
+		_outputFlags.resize(nChannels()*4);
+		_outputData = make_aligned<std::complex<float>>(nChannels()*4, 16);
+		_outputWeights = make_aligned<float>(nChannels()*4, 16);
+		if(_polarizationMode != Writer::LinearPolarizations)
 		{
-			progress.SetProgress(timeIndex-chunkStart, chunkEnd-chunkStart);
-			processAndWriteTimestep(timeIndex, chunkStart);
+			const size_t nValues = nChannels() * Writer::PolarizationCount(_polarizationMode);
+			_reducedData = make_aligned<std::complex<float>>(nValues, 16);
+			_reducedFlags.resize(nValues);
+			_reducedWeights = make_aligned<float>(nValues, 16);
+		}
+		if(useEarlyAveraging())
+		{
+			const size_t nOutTimesteps = _intervalBoundaries.size() - 1;
+			for(size_t t=0; t!=nOutTimesteps; ++t)
+			{
+				progress.SetProgress(t, nOutTimesteps);
+				const size_t start = _intervalBoundaries[t], end = _intervalBoundaries[t+1];
+				double time = 0.0, interval = 0.0;
+				for(size_t bufferIndex=start; bufferIndex!=end; ++bufferIndex)
+				{
+					time += _timestepsStart[bufferIndex];
+					interval += _timestepsEnd[bufferIndex] - _timestepsStart[bufferIndex];
+				}
+				processAndWriteTimestep(t, time / (end-start), interval);
+			}
+		}
+		else {
+			for(size_t timeIndex=chunkStart; timeIndex!=chunkEnd; ++timeIndex)
+			{
+				const size_t bufferIndex = timeIndex-chunkStart;
+				progress.SetProgress(bufferIndex, chunkEnd-chunkStart);
+				processAndWriteTimestep(bufferIndex, _timestepsStart[bufferIndex], _timestepsEnd[bufferIndex] - _timestepsStart[bufferIndex]);
+			}
 		}
 		_writeWatch.Pause();
 		
@@ -394,17 +651,36 @@ void Aartfaac2ms::Run(const char* inputFilename, const char* outputFilename, con
 	
 	std::cout << "Read: " << _readWatch.ToString() << ", processing: " << _processWatch.ToString() << ", writing: " << _writeWatch.ToString() << '\n';
 	
+	_writer->Finish();
 	_writer.reset();
 	
-	if(_collectStatistics) {
+	std::vector<std::string> outputFilenames;
+	if(_shardCount > 1)
+	{
+		for(size_t i=0; i!=_shardCount; ++i)
+			outputFilenames.emplace_back(PartFilename(outputFilename, i));
+	}
+	else {
+		outputFilenames.emplace_back(outputFilename);
+	}
+	
+	// The statistics cover all baselines, so they are written only once.
+	if(_collectStatistics && _outputFormat == MSOutputFormat) {
 		std::cout << "Writing statistics to measurement set...\n";
-		_statistics->WriteStatistics(outputFilename);
+		_statistics->WriteStatistics(outputFilenames.front());
 	}
 	
 	if(_outputFormat == MSOutputFormat)
 	{
 		std::cout << "Writing AARTFAAC fields to measurement set...\n";
-		writeAartfaacFieldsToMS(outputFilename, NTimestepsSelected() /_nParts);
+		for(const std::string& filename : outputFilenames)
+			writeAartfaacFieldsToMS(filename, isFollowing() ? _followChunkSize : NTimestepsSelected() /_nParts);
+		
+		if(_shardCount > 1)
+		{
+			std::cout << "Concatenating " << _shardCount << " measurement set parts...\n";
+			MSWriter::Concatenate(outputFilenames, outputFilename);
+		}
 	}
 }
 
@@ -421,13 +697,200 @@ casacore::Muvw calculateUVW(const casacore::MPosition &antennaPos, const casacor
 	return casacore::Muvw(uvw, casacore::Muvw::J2000);
 }
 
-void Aartfaac2ms::processAndWriteTimestep(size_t timeIndex, size_t chunkStart)
+bool Aartfaac2ms::nextChunk(size_t chunkIndex, size_t& chunkStart, size_t& chunkEnd)
+{
+	if(!isFollowing())
+	{
+		if(chunkIndex == _nParts)
+			return false;
+		chunkStart = this->chunkStart(chunkIndex);
+		chunkEnd = this->chunkStart(chunkIndex+1);
+		return true;
+	}
+	
+	chunkStart = followChunkStart(chunkIndex);
+	chunkEnd = followChunkStart(chunkIndex+1);
+	if(_intervalEnd != 0)
+		chunkEnd = std::min(chunkEnd, _intervalEnd);
+	if(chunkStart >= chunkEnd)
+		return false;
+	// After a timeout, the last chunk is partial
+	waitForTimesteps(chunkEnd);
+	chunkEnd = std::min(chunkEnd, _nTimestepsAvailable);
+	return chunkStart < chunkEnd;
+}
+
+void Aartfaac2ms::waitForTimesteps(size_t end)
+{
+	bool isWaiting = false;
+	while(true)
+	{
+		size_t available = std::numeric_limits<size_t>::max();
+		for(std::unique_ptr<AartfaacFile>& reader : _readers)
+		{
+			reader->Refresh();
+			available = std::min(available, reader->NTimesteps());
+		}
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(available > _nTimestepsAvailable)
+		{
+			_nTimestepsAvailable = available;
+			_lastGrowthTime = now;
+		}
+		if(available >= end)
+			return;
+		if(std::chrono::duration<double>(now - _lastGrowthTime).count() >= _followTimeout)
+		{
+			std::cout << "Input has not grown for " << _followTimeout << " s, finishing.\n";
+			return;
+		}
+		if(!isWaiting)
+		{
+			std::cout << "Waiting for more data...\n";
+			isWaiting = true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+	}
+}
+
+void Aartfaac2ms::readSubband(size_t subband, size_t chunkStart, size_t chunkEnd, const aocommon::UVector<size_t>& baselineMap, ProgressBar* progress)
+{
+	AartfaacFile& reader = *_readers[subband];
+	const size_t
+		nAntennas = reader.NAntennas(),
+		nChannelsInFile = reader.NChannelsInFile(),
+		channelOffset = _subbandChannelOffsets[subband],
+		stride = reader.TimestepStride();
+	
+	// With asynchronous reading, the timesteps are read into a ring of slot
+	// buffers. Each slot holds a header and the visibilities of one timestep.
+	// The buffers are declared first, so that on an exception the reader, which
+	// may still have reads in flight into them, is destructed before them.
+	aocommon::UVector<char> slotBuffers;
+	std::unique_ptr<AsyncReader> asyncReader;
+	size_t nSlots = 0;
+	auto submit = [&](size_t timeIndex) {
+		const size_t slot = (timeIndex - chunkStart) % nSlots;
+		asyncReader->Submit(slot, reader.TimestepOffset(timeIndex), &slotBuffers[slot * stride], stride);
+	};
+	if(_asyncReadDepth != 0)
+	{
+		nSlots = std::min(_asyncReadDepth, chunkEnd - chunkStart);
+		asyncReader = AsyncReader::Make(reader.Filename(), nSlots);
+		slotBuffers.resize(nSlots * stride);
+		for(size_t timeIndex=chunkStart; timeIndex!=chunkStart+nSlots; ++timeIndex)
+			submit(timeIndex);
+	}
+	aocommon::UVector<std::complex<float>> vis(reader.VisPerTimestep());
+	
+	for(size_t timeIndex=chunkStart; timeIndex!=chunkEnd; ++timeIndex)
+	{
+		if(progress)
+			progress->SetProgress(timeIndex-chunkStart, chunkEnd-chunkStart);
+		
+		Timestep step;
+		const std::complex<float>* visPtr;
+		const size_t slot = asyncReader ? (timeIndex - chunkStart) % nSlots : 0;
+		bool isRead = false;
+		if(asyncReader)
+		{
+			try {
+				asyncReader->Wait(slot);
+				isRead = true;
+			} catch(std::exception&) {
+			}
+			const char* slotData = &slotBuffers[slot * stride];
+			const AartfaacHeader& header = *reinterpret_cast<const AartfaacHeader*>(slotData);
+			if(isRead && header.magic == AartfaacHeader::CORR_HDR_MAGIC)
+			{
+				step = Timestep{AartfaacFile::TimeToCasa(header.startTime), AartfaacFile::TimeToCasa(header.endTime), true};
+				visPtr = reinterpret_cast<const std::complex<float>*>(slotData + sizeof(AartfaacHeader));
+			}
+			else {
+				// Let the reader skip the corrupt data, and restart the outstanding
+				// reads at the (possibly shifted) positions that follow it.
+				for(size_t i=0; i!=nSlots; ++i)
+				{
+					try {
+						asyncReader->Wait(i);
+					} catch(std::exception&) {
+					}
+				}
+				reader.SeekToTimestep(timeIndex);
+				step = reader.ReadTimestep(vis.data());
+				visPtr = vis.data();
+				for(size_t t=timeIndex+1; t<timeIndex+nSlots && t<chunkEnd; ++t)
+					submit(t);
+			}
+		}
+		else {
+			step = reader.ReadTimestep(vis.data());
+			visPtr = vis.data();
+		}
+		if(!step.isValid)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_corruptTimesteps.emplace_back(timeIndex - chunkStart);
+		}
+		// All subbands have the same timesteps
+		if(subband == 0)
+		{
+			// A missing timestep is placed directly after the previous one
+			if(!step.isValid && !_timestepsEnd.empty())
+			{
+				const double interval = step.endTime - step.startTime;
+				step.startTime = _timestepsEnd.back();
+				step.endTime = step.startTime + interval;
+			}
+			_timestepsStart.emplace_back(step.startTime);
+			_timestepsEnd.emplace_back(step.endTime);
+		}
+		
+		size_t bufferIndex = timeIndex-chunkStart;
+		for(size_t antenna1=0; antenna1!=nAntennas; ++antenna1)
+		{
+			for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
+			{
+				size_t bIndex = baselineMap[antenna1 + antenna2*nAntennas];
+				if(bIndex == notSelected)
+				{
+					visPtr += nChannelsInFile*4;
+					continue;
+				}
+				ImageSet& imageSet = _imageSetBuffers[bIndex];
+				// Only the selected channels are copied into the image sets
+				for(size_t ch=0; ch!=reader.NChannels(); ++ch)
+				{
+					const std::complex<float>* chPtr = visPtr + reader.ChannelIndexInFile(ch)*4;
+					const size_t y = channelOffset + ch;
+					for(size_t p=0; p!=4; ++p)
+					{
+						float
+							*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
+							*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
+						realPtr[y*imageSet.HorizontalStride()] = chPtr[p].real();
+						imagPtr[y*imageSet.HorizontalStride()] = chPtr[p].imag();
+					}
+				}
+				visPtr += nChannelsInFile*4;
+			}
+		}
+		
+		// The slot is free again, so the next timestep can be requested
+		if(asyncReader && timeIndex + nSlots < chunkEnd)
+			submit(timeIndex + nSlots);
+	}
+	if(asyncReader)
+		reader.SeekToTimestep(chunkEnd);
+}
+
+void Aartfaac2ms::processAndWriteTimestep(size_t bufferIndex, double startTime, double exposure)
 {
+	const bool earlyAveraging = useEarlyAveraging();
+	const aocommon::UVector<double>& channelFrequenciesHz = earlyAveraging ? _averagedChannelFrequenciesHz : _channelFrequenciesHz;
 	const size_t nAntennas = _reader->NAntennas();
-	const size_t nChannels = _reader->NChannels();
-	const size_t nBaselines = nAntennas*(nAntennas+1)/2;
-	const double startTime = _timestepsStart[timeIndex - chunkStart];
-	const double exposure = _timestepsEnd[timeIndex - chunkStart] - startTime;
+	const size_t nChannels = channelFrequenciesHz.size();
+	const size_t nBaselines = _baselines.size();
 	
 	_uvws.resize(_reader->NAntennas());
 	casacore::MEpoch timeEpoch = casacore::MEpoch(casacore::MVEpoch(startTime/86400.0), casacore::MEpoch::UTC);
@@ -443,100 +906,148 @@ void Aartfaac2ms::processAndWriteTimestep(size_t timeIndex, size_t chunkStart)
 		cosAngles(nChannels),
 		sinAngles(nChannels);
 	
-	initializeWeights(_outputWeights.get(), exposure);
-	size_t baselineIndex = 0;
-	for(size_t antenna1=0; antenna1!=nAntennas; ++antenna1)
+	if(!earlyAveraging)
+		initializeWeights(_outputWeights.get(), exposure);
+	const size_t nOutTimesteps = earlyAveraging ? _intervalBoundaries.size() - 1 : 0;
+	for(size_t baselineIndex=0; baselineIndex!=nBaselines; ++baselineIndex)
 	{
-		for(size_t antenna2=antenna1; antenna2!=nAntennas; ++antenna2)
+		const size_t
+			antenna1 = _baselines[baselineIndex].first,
+			antenna2 = _baselines[baselineIndex].second;
+		const ImageSet& imageSet = _imageSetBuffers[baselineIndex];
+		const FlagMask& flagMask = _flagBuffers[baselineIndex];
+		
+		const size_t stride = imageSet.HorizontalStride();
+		const size_t flagStride = flagMask.HorizontalStride();
+		double
+			u = _uvws[antenna1].u - _uvws[antenna2].u,
+			v = _uvws[antenna1].v - _uvws[antenna2].v,
+			w = _uvws[antenna1].w - _uvws[antenna2].w;
+				
+		// Pre-calculate rotation coefficients for geometric phase delay correction
+		for(size_t ch=0; ch!=nChannels; ++ch)
 		{
-			const ImageSet& imageSet = _imageSetBuffers[baselineIndex];
-			const FlagMask& flagMask = _flagBuffers[baselineIndex];
-			
-			const size_t stride = imageSet.HorizontalStride();
-			const size_t flagStride = flagMask.HorizontalStride();
-			double
-				u = _uvws[antenna1].u - _uvws[antenna2].u,
-				v = _uvws[antenna1].v - _uvws[antenna2].v,
-				w = _uvws[antenna1].w - _uvws[antenna2].w;
-					
-			// Pre-calculate rotation coefficients for geometric phase delay correction
+			double angle = -2.0*M_PI*w*channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
+			sinAngles[ch] = sin(angle);
+			cosAngles[ch] = cos(angle);
+		}
+		
+		if(earlyAveraging)
+		{
+			const float* weights = &_averagedWeights[baselineIndex * _averagedWeightsStride + bufferIndex];
 			for(size_t ch=0; ch!=nChannels; ++ch)
 			{
-				double angle = -2.0*M_PI*w*_channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
-				sinAngles[ch] = sin(angle);
-				cosAngles[ch] = cos(angle);
+				for(size_t p=0; p!=4; ++p)
+					_outputWeights[ch*4 + p] = weights[ch*nOutTimesteps];
 			}
+		}
 
-			size_t bufferIndex = timeIndex - chunkStart;
 #ifndef USE_SSE
-			for(size_t p=0; p!=4; ++p)
-			{
-				const float
-					*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
-					*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
-				const bool *flagPtr = flagMask.Buffer()+bufferIndex;
-				std::complex<float> *outDataPtr = &_outputData[p];
-				bool *outputFlagPtr = &_outputFlags[p];
-				for(size_t ch=0; ch!=nChannels; ++ch)
-				{
-					const float rtmp = *realPtr, itmp = *imagPtr;
-					// Apply geometric phase delay (for w)
-					*outDataPtr = std::complex<float>(
-						cosAngles[ch] * rtmp - sinAngles[ch] * itmp,
-						sinAngles[ch] * rtmp + cosAngles[ch] * itmp
-					);
-					*outputFlagPtr = *flagPtr;
-					realPtr += stride;
-					imagPtr += stride;
-					flagPtr += flagStride;
-					outDataPtr += 4;
-					outputFlagPtr += 4;
-				}
-			}
-	#else
+		for(size_t p=0; p!=4; ++p)
+		{
 			const float
-				*realAPtr = imageSet.ImageBuffer(0)+bufferIndex,
-				*imagAPtr = imageSet.ImageBuffer(1)+bufferIndex,
-				*realBPtr = imageSet.ImageBuffer(2)+bufferIndex,
-				*imagBPtr = imageSet.ImageBuffer(3)+bufferIndex,
-				*realCPtr = imageSet.ImageBuffer(4)+bufferIndex,
-				*imagCPtr = imageSet.ImageBuffer(5)+bufferIndex,
-				*realDPtr = imageSet.ImageBuffer(6)+bufferIndex,
-				*imagDPtr = imageSet.ImageBuffer(7)+bufferIndex;
+				*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
+				*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
 			const bool *flagPtr = flagMask.Buffer()+bufferIndex;
-			std::complex<float> *outDataPtr = &_outputData[0];
-			bool *outputFlagPtr = &_outputFlags[0];
+			std::complex<float> *outDataPtr = &_outputData[p];
+			bool *outputFlagPtr = &_outputFlags[p];
 			for(size_t ch=0; ch!=nChannels; ++ch)
 			{
+				const float rtmp = *realPtr, itmp = *imagPtr;
 				// Apply geometric phase delay (for w)
-				// Note that order within set_ps is reversed; for the four complex numbers,
-				// the first two compl are loaded corresponding to set_ps(imag2, real2, imag1, real1).
-				__m128 ra = _mm_set_ps(*realBPtr, *realBPtr, *realAPtr, *realAPtr);
-				__m128 rb = _mm_set_ps(*realDPtr, *realDPtr, *realCPtr, *realCPtr);
-				__m128 rgeom = _mm_set_ps(sinAngles[ch], cosAngles[ch], sinAngles[ch], cosAngles[ch]);
-				__m128 ia = _mm_set_ps(*imagBPtr, *imagBPtr, *imagAPtr, *imagAPtr);
-				__m128 ib = _mm_set_ps(*imagDPtr, *imagDPtr, *imagCPtr, *imagCPtr);
-				__m128 igeom = _mm_set_ps(cosAngles[ch], -sinAngles[ch], cosAngles[ch], -sinAngles[ch]);
-				__m128 outa = _mm_add_ps(_mm_mul_ps(ra, rgeom), _mm_mul_ps(ia, igeom));
-				__m128 outb = _mm_add_ps(_mm_mul_ps(rb, rgeom), _mm_mul_ps(ib, igeom));
-				_mm_store_ps((float*) outDataPtr, outa);
-				_mm_store_ps((float*) (outDataPtr+2), outb);
-				
-				*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-				*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-				*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-				*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-				realAPtr += stride; imagAPtr += stride;
-				realBPtr += stride; imagBPtr += stride;
-				realCPtr += stride; imagCPtr += stride;
-				realDPtr += stride; imagDPtr += stride;
+				*outDataPtr = std::complex<float>(
+					cosAngles[ch] * rtmp - sinAngles[ch] * itmp,
+					sinAngles[ch] * rtmp + cosAngles[ch] * itmp
+				);
+				*outputFlagPtr = *flagPtr;
+				realPtr += stride;
+				imagPtr += stride;
 				flagPtr += flagStride;
 				outDataPtr += 4;
+				outputFlagPtr += 4;
 			}
-	#endif
-				
+		}
+#else
+		const float
+			*realAPtr = imageSet.ImageBuffer(0)+bufferIndex,
+			*imagAPtr = imageSet.ImageBuffer(1)+bufferIndex,
+			*realBPtr = imageSet.ImageBuffer(2)+bufferIndex,
+			*imagBPtr = imageSet.ImageBuffer(3)+bufferIndex,
+			*realCPtr = imageSet.ImageBuffer(4)+bufferIndex,
+			*imagCPtr = imageSet.ImageBuffer(5)+bufferIndex,
+			*realDPtr = imageSet.ImageBuffer(6)+bufferIndex,
+			*imagDPtr = imageSet.ImageBuffer(7)+bufferIndex;
+		const bool *flagPtr = flagMask.Buffer()+bufferIndex;
+		std::complex<float> *outDataPtr = &_outputData[0];
+		bool *outputFlagPtr = &_outputFlags[0];
+		for(size_t ch=0; ch!=nChannels; ++ch)
+		{
+			// Apply geometric phase delay (for w)
+			// Note that order within set_ps is reversed; for the four complex numbers,
+			// the first two compl are loaded corresponding to set_ps(imag2, real2, imag1, real1).
+			__m128 ra = _mm_set_ps(*realBPtr, *realBPtr, *realAPtr, *realAPtr);
+			__m128 rb = _mm_set_ps(*realDPtr, *realDPtr, *realCPtr, *realCPtr);
+			__m128 rgeom = _mm_set_ps(sinAngles[ch], cosAngles[ch], sinAngles[ch], cosAngles[ch]);
+			__m128 ia = _mm_set_ps(*imagBPtr, *imagBPtr, *imagAPtr, *imagAPtr);
+			__m128 ib = _mm_set_ps(*imagDPtr, *imagDPtr, *imagCPtr, *imagCPtr);
+			__m128 igeom = _mm_set_ps(cosAngles[ch], -sinAngles[ch], cosAngles[ch], -sinAngles[ch]);
+			__m128 outa = _mm_add_ps(_mm_mul_ps(ra, rgeom), _mm_mul_ps(ia, igeom));
+			__m128 outb = _mm_add_ps(_mm_mul_ps(rb, rgeom), _mm_mul_ps(ib, igeom));
+			_mm_store_ps((float*) outDataPtr, outa);
+			_mm_store_ps((float*) (outDataPtr+2), outb);
+			
+			*outputFlagPtr = *flagPtr; ++outputFlagPtr;
+			*outputFlagPtr = *flagPtr; ++outputFlagPtr;
+			*outputFlagPtr = *flagPtr; ++outputFlagPtr;
+			*outputFlagPtr = *flagPtr; ++outputFlagPtr;
+			realAPtr += stride; imagAPtr += stride;
+			realBPtr += stride; imagBPtr += stride;
+			realCPtr += stride; imagCPtr += stride;
+			realDPtr += stride; imagDPtr += stride;
+			flagPtr += flagStride;
+			outDataPtr += 4;
+		}
+#endif
+			
+		if(_polarizationMode == Writer::LinearPolarizations)
 			_writer->WriteRow(startTime, startTime, antenna1, antenna2, u, v, w, exposure, _outputData.get(), _outputFlags.data(), _outputWeights.get());
-			++baselineIndex;
+		else {
+			reducePolarizations(nChannels);
+			_writer->WriteRow(startTime, startTime, antenna1, antenna2, u, v, w, exposure, _reducedData.get(), _reducedFlags.data(), _reducedWeights.get());
+		}
+	}
+}
+
+void Aartfaac2ms::reducePolarizations(size_t nChannels)
+{
+	// The output buffers are not modified, because the weights are reused for
+	// the next baseline.
+	const std::complex<float>* data = _outputData.get();
+	const bool* flags = _outputFlags.data();
+	const float* weights = _outputWeights.get();
+	if(_polarizationMode == Writer::DiagonalPolarizations)
+	{
+		for(size_t ch=0; ch!=nChannels; ++ch)
+		{
+			_reducedData[ch*2] = data[ch*4];
+			_reducedData[ch*2 + 1] = data[ch*4 + 3];
+			_reducedFlags[ch*2] = flags[ch*4];
+			_reducedFlags[ch*2 + 1] = flags[ch*4 + 3];
+			_reducedWeights[ch*2] = weights[ch*4];
+			_reducedWeights[ch*2 + 1] = weights[ch*4 + 3];
+		}
+	}
+	else {
+		// I = (XX + YY) / 2, which has a variance of (var XX + var YY) / 4
+		for(size_t ch=0; ch!=nChannels; ++ch)
+		{
+			const float
+				weightXX = weights[ch*4],
+				weightYY = weights[ch*4 + 3],
+				weightSum = weightXX + weightYY;
+			_reducedData[ch] = (data[ch*4] + data[ch*4 + 3]) * 0.5f;
+			_reducedFlags[ch] = flags[ch*4] || flags[ch*4 + 3];
+			_reducedWeights[ch] = (weightSum == 0.0f) ? 0.0f : 4.0f * weightXX * weightYY / weightSum;
 		}
 	}
 }
@@ -575,8 +1086,7 @@ void Aartfaac2ms::readAntennaPositions(const char* antennaConfFilename)
 	size_t lastTimestep = _intervalEnd;
 	if(lastTimestep == 0)
 		lastTimestep = _reader->NTimesteps();
-	_reader->SeekToTimestep((_intervalStart + lastTimestep) / 2);
-	double centralTime = _reader->ReadMetadata().startTime;
+	double centralTime = _reader->TimestepMetadata((_intervalStart + lastTimestep) / 2).startTime;
 	casacore::MEpoch time = casacore::MEpoch(casacore::MVEpoch(centralTime/86400.0), casacore::MEpoch::UTC);
 	casacore::MeasFrame frame(_antennaPositions[0], time);
 
@@ -597,13 +1107,145 @@ void Aartfaac2ms::readAntennaPositions(const char* antennaConfFilename)
 	}
 }
 
+void Aartfaac2ms::detectBadAntennas()
+{
+	// Auto-correlation power per antenna is determined from a few timesteps
+	// spread over the selected interval. Antennas of which the median power is
+	// zero or far from that of the other antennas are marked as bad.
+	const size_t
+		nAntennas = _reader->NAntennas(),
+		nChannelsInFile = _reader->NChannelsInFile(),
+		nTimesteps = NTimestepsSelected(),
+		nSamples = std::min<size_t>(nTimesteps, 10);
+	if(nSamples == 0)
+		return;
+	aocommon::UVector<std::complex<float>> vis(_reader->VisPerTimestep());
+	std::vector<std::vector<double>> powers(nAntennas, std::vector<double>(nSamples));
+	for(size_t sample=0; sample!=nSamples; ++sample)
+	{
+		_reader->SeekToTimestep(_intervalStart + (2*sample + 1) * nTimesteps / (2*nSamples));
+		// A corrupt timestep has zero power, which the median mostly ignores
+		_reader->ReadTimestep(vis.data());
+		for(size_t antenna=0; antenna!=nAntennas; ++antenna)
+		{
+			// Baselines are stored with antenna2 <= antenna1, so the
+			// auto-correlation is the last baseline of antenna1.
+			const size_t autoIndex = antenna*(antenna+1)/2 + antenna;
+			const std::complex<float>* autoPtr = &vis[autoIndex * nChannelsInFile * 4];
+			double power = 0.0;
+			for(size_t ch=0; ch!=_reader->NChannels(); ++ch)
+			{
+				const std::complex<float>* chPtr = autoPtr + _reader->ChannelIndexInFile(ch)*4;
+				power += chPtr[0].real() + chPtr[3].real();
+			}
+			powers[antenna][sample] = power / _reader->NChannels();
+		}
+	}
+	
+	// Median over the samples makes this robust against RFI in a single timestep
+	std::vector<double> logPowers;
+	std::vector<double> antennaPowers(nAntennas);
+	for(size_t antenna=0; antenna!=nAntennas; ++antenna)
+	{
+		std::vector<double>& p = powers[antenna];
+		std::nth_element(p.begin(), p.begin() + p.size()/2, p.end());
+		antennaPowers[antenna] = p[p.size()/2];
+		if(std::isfinite(antennaPowers[antenna]) && antennaPowers[antenna] > 0.0)
+			logPowers.emplace_back(std::log10(antennaPowers[antenna]));
+	}
+	
+	double median = 0.0, mad = 0.0;
+	if(!logPowers.empty())
+	{
+		std::nth_element(logPowers.begin(), logPowers.begin() + logPowers.size()/2, logPowers.end());
+		median = logPowers[logPowers.size()/2];
+		std::vector<double> deviations;
+		for(double logPower : logPowers)
+			deviations.emplace_back(std::fabs(logPower - median));
+		std::nth_element(deviations.begin(), deviations.begin() + deviations.size()/2, deviations.end());
+		mad = deviations[deviations.size()/2];
+	}
+	// Besides 5 sigma, at least a factor of 3 difference in power is required
+	const double maxDeviation = std::max(5.0 * 1.4826 * mad, std::log10(3.0));
+	
+	size_t badCount = 0;
+	for(size_t antenna=0; antenna!=nAntennas; ++antenna)
+	{
+		const double power = antennaPowers[antenna];
+		if(!std::isfinite(power) || power <= 0.0 || std::fabs(std::log10(power) - median) > maxDeviation)
+		{
+			_isBadAntenna[antenna] = true;
+			if(badCount == 0)
+				std::cout << "Bad antennas:";
+			std::cout << ' ' << antenna;
+			++badCount;
+		}
+	}
+	if(badCount == 0)
+		std::cout << "No bad antennas detected.\n";
+	else
+		std::cout << " (" << badCount << " of " << nAntennas << ")\n";
+}
+
+void Aartfaac2ms::selectBaselines()
+{
+	const size_t nAntennas = _reader->NAntennas();
+	std::vector<bool> isExcluded(nAntennas, false);
+	for(size_t antenna : _excludedAntennas)
+	{
+		if(antenna >= nAntennas)
+			throw std::runtime_error("Excluded antenna " + std::to_string(antenna) + " does not exist");
+		isExcluded[antenna] = true;
+	}
+	if(_omitBadAntennas)
+	{
+		for(size_t antenna=0; antenna!=nAntennas; ++antenna)
+		{
+			if(_isBadAntenna[antenna])
+				isExcluded[antenna] = true;
+		}
+	}
+	
+	_baselines.clear();
+	for(size_t antenna1=0; antenna1!=nAntennas; ++antenna1)
+	{
+		if(isExcluded[antenna1])
+			continue;
+		for(size_t antenna2=antenna1; antenna2!=nAntennas; ++antenna2)
+		{
+			if(isExcluded[antenna2])
+				continue;
+			if(antenna1 != antenna2)
+			{
+				const casacore::Vector<double>
+					pos1 = _antennaPositions[antenna1].getValue().getVector(),
+					pos2 = _antennaPositions[antenna2].getValue().getVector();
+				const double
+					dx = pos1[0] - pos2[0],
+					dy = pos1[1] - pos2[1],
+					dz = pos1[2] - pos2[2],
+					length = std::sqrt(dx*dx + dy*dy + dz*dz);
+				if(length < _minBaselineLength || (_maxBaselineLength != 0.0 && length > _maxBaselineLength))
+					continue;
+			}
+			_baselines.emplace_back(antenna1, antenna2);
+		}
+	}
+	if(_baselines.empty())
+		throw std::runtime_error("No baselines selected");
+	
+	const size_t nBaselines = nAntennas * (nAntennas + 1) / 2;
+	if(_baselines.size() != nBaselines)
+		std::cout << "Selected " << _baselines.size() << " of " << nBaselines << " baselines.\n";
+}
+
 void Aartfaac2ms::initializeWeights(float* outputWeights, double integrationTime)
 {
 	// Weights are normalized so that a 'reasonable' res of 200 kHz, 1s has
 	// weight of "1" per sample.
 	// Note that this only holds for numbers in the WEIGHTS_SPECTRUM column; WEIGHTS will hold the sum.
-	double weightFactor = integrationTime * (_reader->Bandwidth()/_reader->NChannels());
-	for(size_t ch=0; ch!=_reader->NChannels(); ++ch)
+	double weightFactor = integrationTime * _reader->ChannelWidth();
+	for(size_t ch=0; ch!=nChannels(); ++ch)
 	{
 		for(size_t p=0; p!=4; ++p)
 			outputWeights[ch*4 + p] = weightFactor;
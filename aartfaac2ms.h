@@ -17,10 +17,14 @@
 #include <casacore/measures/Measures/MDirection.h>
 #include <casacore/measures/Measures/MPosition.h>
 
+#include <algorithm>
+#include <chrono>
 #include <complex>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
 struct UVW { double u, v, w; };
@@ -28,17 +32,92 @@ struct UVW { double u, v, w; };
 class Aartfaac2ms
 {
 public:
-	enum OutputFormat { MSOutputFormat, FitsOutputFormat };
+	enum OutputFormat { MSOutputFormat, FitsOutputFormat, RawOutputFormat };
 		
 	Aartfaac2ms();
 	
-	void Run(const char* inputFilename, const char* outputFilename, const char* antennaConfFilename, AartfaacMode mode);
+	/**
+	 * Convert one or more subband files of the same observation. The channels
+	 * of all subbands are combined into one band, in order of frequency.
+	 */
+	void Run(const std::vector<std::string>& inputFilenames, const char* outputFilename, const char* antennaConfFilename, AartfaacMode mode);
 	
 	void SetMemPercentage(double memPercentage) { _memPercentage = memPercentage; }
 	void SetThreadCount(size_t nThreads) { _threadCount = nThreads; }
+	void SetShardCount(size_t nShards) { _shardCount = nShards; }
+	void SetOutputFormat(OutputFormat format) { _outputFormat = format; }
+	/**
+	 * Write only XX and YY, or only Stokes I, instead of all four linear
+	 * correlations. The polarizations are combined after flagging.
+	 */
+	void SetPolarizationMode(Writer::PolarizationMode mode) { _polarizationMode = mode; }
 	void SetTimeAveraging(size_t factor) { _timeAvgFactor = factor; }
 	void SetFrequencyAveraging(size_t factor) { _freqAvgFactor = factor; }
+	void SetBaselineDependentAveraging(double maxDecorrelation) { _maxDecorrelation = maxDecorrelation; }
+	/**
+	 * Average the flagged data per baseline in the processing threads, instead
+	 * of averaging the written rows with an AveragingWriter. This only supports
+	 * constant averaging factors, i.e. no baseline-dependent averaging.
+	 */
+	void SetEarlyAveraging(bool earlyAveraging) { _earlyAveraging = earlyAveraging; }
 	void SetInterval(size_t start, size_t end) { _intervalStart = start; _intervalEnd = end; }
+	/**
+	 * Follow input files that are still being written. Timesteps are processed
+	 * in chunks of the given size as soon as they have arrived, which bounds the
+	 * latency. The conversion ends when the files have not grown for the given
+	 * timeout (in seconds).
+	 */
+	void SetFollowMode(size_t chunkSize, double timeout)
+	{
+		_followChunkSize = chunkSize;
+		_followTimeout = timeout;
+	}
+	/**
+	 * Read the input with direct I/O, bypassing the page cache.
+	 */
+	void SetDirectIO(bool directIO) { _directIO = directIO; }
+	/**
+	 * Read the input asynchronously, with up to the given number of timesteps
+	 * being read at the same time. Zero turns asynchronous reading off. This
+	 * can not be combined with direct I/O.
+	 */
+	void SetAsyncReadDepth(size_t queueDepth) { _asyncReadDepth = queueDepth; }
+	/**
+	 * Only read the channels start, start+step, ... up to (but not including)
+	 * end. An end of zero selects up to the last channel.
+	 */
+	void SetChannelSelection(size_t start, size_t end, size_t step)
+	{
+		_channelStart = start;
+		_channelEnd = end;
+		_channelStep = step;
+	}
+	/**
+	 * Leave out all baselines with one of the given antennas. Selected baselines
+	 * are read, flagged and written; other baselines are skipped entirely.
+	 */
+	void SetExcludedAntennas(const std::vector<size_t>& antennas) { _excludedAntennas = antennas; }
+	/**
+	 * Only select cross-correlations with a length in the given range (in
+	 * meters). A maximum of zero means no maximum. Auto-correlations of
+	 * selected antennas are always kept.
+	 */
+	void SetBaselineLengthRange(double minLength, double maxLength)
+	{
+		_minBaselineLength = minLength;
+		_maxBaselineLength = maxLength;
+	}
+	/**
+	 * Before processing, find dead or outlying antennas from the auto-correlation
+	 * power in a sample of timesteps. The baselines of these antennas are
+	 * flagged without running the flagging strategy, or if omit is set, they
+	 * are left out as if they were excluded.
+	 */
+	void SetBadAntennaDetection(bool detect, bool omit)
+	{
+		_detectBadAntennas = detect;
+		_omitBadAntennas = omit;
+	}
 	void SetPhaseCentre(double ra, double dec) {
 		_manualPhaseCentre = true;
 		_manualPhaseCentreRA = ra;
@@ -57,12 +136,20 @@ public:
 	
 private:
 	void allocateBuffers();
-	void processAndWriteTimestep(size_t timeIndex, size_t chunkStart);
+	bool nextChunk(size_t chunkIndex, size_t& chunkStart, size_t& chunkEnd);
+	void waitForTimesteps(size_t end);
+	void readSubband(size_t subband, size_t chunkStart, size_t chunkEnd, const aocommon::UVector<size_t>& baselineMap, ProgressBar* progress);
+	void processAndWriteTimestep(size_t bufferIndex, double time, double interval);
 	void initializeWriter(const char* outputFilename);
+	std::unique_ptr<Writer> makeOutputWriter(const std::string& outputFilename);
 	void initializeWeights(float* outputWeights, double integrationTime);
+	void reducePolarizations(size_t nChannels);
 	void readAntennaPositions(const char* antennaConfFilename);
+	void detectBadAntennas();
+	void selectBaselines();
 	void baselineProcessThreadFunc(ProgressBar* progressBar);
 	void processBaseline(size_t baseline, aoflagger::Strategy& threadStrategy, aoflagger::QualityStatistics& threadStatistics);
+	void averageBaseline(size_t baseline);
 	void writeAartfaacFieldsToMS(const std::string& outputFilename, size_t flagWindowSize);
 	
 	void setAntennas();
@@ -71,15 +158,86 @@ private:
 	void setField();
 	void setObservation();
 	
+	bool useEarlyAveraging() const
+	{
+		return _earlyAveraging && (_timeAvgFactor != 1 || _freqAvgFactor != 1) && _maxDecorrelation == 0.0;
+	}
+	
+	double firstSelectedTime() const
+	{
+		return _reader->StartTime() + _intervalStart * _reader->IntegrationTime();
+	}
+	
+	/**
+	 * Number of (possibly partial) averaging intervals that overlap with the
+	 * selected timesteps, given the time grid.
+	 */
+	size_t nTimeIntervals() const
+	{
+		const size_t nTimesteps = NTimestepsSelected();
+		if(nTimesteps == 0)
+			return 0;
+		return (nTimesteps + _timeGridPhase - 1) / _timeAvgFactor + 1;
+	}
+	
+	/**
+	 * First selected timestep (relative to the selection) of the given
+	 * averaging interval.
+	 */
+	size_t timeIntervalStart(size_t interval) const
+	{
+		return std::min(NTimestepsSelected(), std::max(interval*_timeAvgFactor, _timeGridPhase) - _timeGridPhase);
+	}
+	
+	/**
+	 * First timestep of the given chunk. With early averaging, chunks
+	 * contain whole averaging intervals.
+	 */
+	size_t chunkStart(size_t chunkIndex) const
+	{
+		const size_t nTimesteps = NTimestepsSelected();
+		if(useEarlyAveraging())
+			return timeIntervalStart(nTimeIntervals()*chunkIndex/_nParts) + _intervalStart;
+		else
+			return nTimesteps*chunkIndex/_nParts + _intervalStart;
+	}
+	
+	bool isFollowing() const { return _followChunkSize != 0; }
+	
+	/**
+	 * First timestep of the given chunk when following the input. With early
+	 * averaging, the chunk size is a multiple of the averaging factor.
+	 */
+	size_t followChunkStart(size_t chunkIndex) const
+	{
+		if(useEarlyAveraging())
+			return std::max(chunkIndex*_followChunkSize, _timeGridPhase) - _timeGridPhase + _intervalStart;
+		else
+			return chunkIndex*_followChunkSize + _intervalStart;
+	}
+	
+	/**
+	 * Total number of selected channels of all subbands.
+	 */
+	size_t nChannels() const { return _subbandChannelOffsets.back(); }
+	
 	size_t NTimestepsSelected() const
 	{
 		size_t nTimesteps = _reader->NTimesteps();
+		for(const std::unique_ptr<AartfaacFile>& reader : _readers)
+			nTimesteps = std::min(nTimesteps, reader->NTimesteps());
+		nTimesteps = nTimesteps > _intervalStart ? nTimesteps - _intervalStart : 0;
 		if(_intervalEnd!=0 && nTimesteps>(_intervalEnd-_intervalStart))
 			nTimesteps = _intervalEnd - _intervalStart;
 		return nTimesteps;
 	}
 	
-	std::unique_ptr<class AartfaacFile> _reader;
+	std::vector<std::unique_ptr<AartfaacFile>> _readers;
+	// The first subband, which is used for metadata
+	AartfaacFile* _reader;
+	// Index of the first channel of each subband, followed by the total
+	std::vector<size_t> _subbandChannelOffsets;
+	static constexpr size_t notSelected = std::numeric_limits<size_t>::max();
 	aoflagger::AOFlagger _flagger;
 	std::unique_ptr<aoflagger::QualityStatistics> _statistics;
 	std::unique_ptr<Writer> _writer;
@@ -90,10 +248,22 @@ private:
 	// settings
 	AartfaacMode _mode;
 	OutputFormat _outputFormat;
+	Writer::PolarizationMode _polarizationMode;
 	bool _rfiDetection, _collectStatistics, _collectHistograms;
 	size_t _timeAvgFactor, _freqAvgFactor;
+	double _maxDecorrelation;
+	bool _earlyAveraging;
+	size_t _timeGridPhase;
 	double _memPercentage;
 	size_t _intervalStart, _intervalEnd;
+	size_t _followChunkSize;
+	double _followTimeout;
+	bool _directIO;
+	size_t _asyncReadDepth;
+	size_t _channelStart, _channelEnd, _channelStep;
+	std::vector<size_t> _excludedAntennas;
+	double _minBaselineLength, _maxBaselineLength;
+	bool _detectBadAntennas, _omitBadAntennas;
 	bool _manualPhaseCentre;
 	double _manualPhaseCentreRA, _manualPhaseCentreDec;
 	bool _useDysco;
@@ -103,24 +273,43 @@ private:
 	std::string _dyscoNormalization;
 	double _dyscoDistTruncation;
 	size_t _threadCount;
+	size_t _shardCount;
 	
 	// data fields
 	size_t _nParts;
+	// Timesteps available in all input files, and when that last changed
+	size_t _nTimestepsAvailable;
+	std::chrono::steady_clock::time_point _lastGrowthTime;
 	std::vector<aoflagger::ImageSet> _imageSetBuffers;
 	std::vector<aoflagger::FlagMask> _flagBuffers;
 	aoflagger::FlagMask _correlatorMask;
 	std::vector<double> _timestepsStart, _timestepsEnd;
+	// Timesteps in the current chunk that were corrupt or missing in the input
+	std::vector<size_t> _corruptTimesteps;
+	// Selected baselines, in the order of _imageSetBuffers
 	std::vector<std::pair<size_t, size_t>> _baselines;
 	std::vector<UVW> _uvws;
 	std::vector<casacore::MPosition> _antennaPositions;
+	std::vector<bool> _isBadAntenna;
 	std::array<double, 9> _antennaAxes;
 	casacore::MDirection _phaseDirection;
 	aocommon::UVector<double> _channelFrequenciesHz;
 	
+	// early averaging
+	aocommon::UVector<double> _averagedChannelFrequenciesHz;
+	aocommon::UVector<float> _timestepWeights;
+	std::vector<size_t> _intervalBoundaries;
+	aocommon::UVector<float> _averagedWeights;
+	size_t _averagedWeightsStride;
+	
 	// write buffers
 	aocommon::UVector<bool> _outputFlags;
 	aligned_ptr<std::complex<float>> _outputData;
 	aligned_ptr<float> _outputWeights;
+	// Output with reduced polarizations, see reducePolarizations()
+	aligned_ptr<std::complex<float>> _reducedData;
+	aocommon::UVector<bool> _reducedFlags;
+	aligned_ptr<float> _reducedWeights;
 	
 	Stopwatch _readWatch, _processWatch, _writeWatch;
 };
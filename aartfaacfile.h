@@ -2,17 +2,30 @@
 #define AARTFAAC_FILE_H
 
 #include "aartfaacheader.h"
+#include "aartfaacindex.h"
 #include "aartfaacmode.h"
+#include "aligned_ptr.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <complex>
 #include <fstream>
 #include <stdexcept>
+#include <string>
 #include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 struct Timestep
 {
 	double startTime, endTime;
+	// False when the timestep was corrupt or missing in the file
+	bool isValid;
 };
 
 // An AARTFAAC file has a header followed by the data, which is written as:
@@ -20,7 +33,10 @@ struct Timestep
 class AartfaacFile {
 public:
 	AartfaacFile(const char* filename, AartfaacMode mode) :
-		_file(filename), _mode(mode), _blockPos(0)
+		_file(filename), _filename(filename), _mode(mode), _blockPos(0), _offsetShift(0),
+		_channelStart(0), _channelEnd(0), _channelStep(1),
+		_directFd(-1), _directBuffer(empty_aligned<char>()),
+		_directBufferOffset(0), _directBufferFill(0)
 	{
 		_file.seekg(0, std::ios::end);
 		_filesize = _file.tellg();
@@ -32,6 +48,9 @@ public:
 		_header.Check();
 		
 		_blockSize = sizeof(std::complex<float>) * _header.VisPerTimestep();
+		_channelEnd = _header.nrChannels;
+		checkTrailingBytes(filename);
+		loadIndex(filename);
 		
 		std::string fn(filename);
 		size_t sbIndex = fn.rfind("SB");
@@ -51,7 +70,10 @@ public:
 	}
 	
 	AartfaacFile(const char* filename) :
-		_file(filename), _mode(AartfaacMode::Unused), _blockPos(0)
+		_file(filename), _filename(filename), _mode(AartfaacMode::Unused), _blockPos(0), _offsetShift(0),
+		_channelStart(0), _channelEnd(0), _channelStep(1),
+		_directFd(-1), _directBuffer(empty_aligned<char>()),
+		_directBufferOffset(0), _directBufferFill(0)
 	{
 		_file.seekg(0, std::ios::end);
 		_filesize = _file.tellg();
@@ -63,67 +85,270 @@ public:
 		_header.Check();
 		
 		_blockSize = sizeof(std::complex<float>) * _header.VisPerTimestep();
+		_channelEnd = _header.nrChannels;
+		checkTrailingBytes(filename);
+		loadIndex(filename);
 		
 		SeekToTimestep(0);
 	}
 	
+	~AartfaacFile()
+	{
+		if(_directFd >= 0)
+			close(_directFd);
+	}
+	
+	AartfaacFile(const AartfaacFile&) = delete;
+	AartfaacFile& operator=(const AartfaacFile&) = delete;
+	
+	/**
+	 * Read the visibilities with direct I/O (O_DIRECT), bypassing the page
+	 * cache. Data is read in large aligned blocks that hold several timesteps.
+	 * This avoids filling the cache with data that is read only once. Returns
+	 * false when the file system does not support direct I/O, in which case
+	 * normal reads are used.
+	 */
+	bool EnableDirectIO()
+	{
+		if(_directFd >= 0)
+			return true;
+		_directFd = open(_filename.c_str(), O_RDONLY | O_DIRECT);
+		if(_directFd < 0)
+			return false;
+		const size_t stride = sizeof(AartfaacHeader) + _blockSize;
+		// Most timesteps are smaller than the read size, but large ones should fit as well
+		const size_t strideCapacity = (stride + 2*directAlignment - 1) / directAlignment * directAlignment;
+		_directBufferCapacity = strideCapacity > directReadSize ? strideCapacity : directReadSize;
+		_directBuffer = make_aligned<char>(_directBufferCapacity, directAlignment);
+		_directBufferOffset = 0;
+		_directBufferFill = 0;
+		return true;
+	}
+	
 	void SkipTimesteps(int count)
 	{
-		_file.seekg(count * (sizeof(AartfaacHeader) + _blockSize), std::ios::cur);
-		_blockPos += count;
+		SeekToTimestep(_blockPos + count);
 	}
 	
 	void SeekToTimestep(size_t timestep)
 	{
-		_file.seekg(timestep * (sizeof(AartfaacHeader) + _blockSize), std::ios::beg);
+		_file.seekg(TimestepOffset(timestep), std::ios::beg);
 		_blockPos = timestep;
 	}
 	
+	/**
+	 * Read the next timestep. When it is corrupt or missing, the buffer is
+	 * zeroed and the returned timestep is marked invalid; reading then
+	 * continues at the next valid header in the file.
+	 */
 	Timestep ReadTimestep(std::complex<float>* buffer)
 	{
+		if(_hasIndex && _blockPos < _index.Size() && !_index[_blockPos].IsValid())
+			return missingTimestep(buffer);
 		AartfaacHeader h;
-		_file.read(reinterpret_cast<char*>(&h), sizeof(AartfaacHeader));
-		_file.read(reinterpret_cast<char*>(buffer), _blockSize);
-		if(!_file)
-			throw std::runtime_error("Error reading file");
+		bool isRead;
+		if(_directFd >= 0)
+		{
+			const uint64_t offset = TimestepOffset(_blockPos);
+			try {
+				readDirect(offset, reinterpret_cast<char*>(&h), sizeof(AartfaacHeader));
+				readDirect(offset + sizeof(AartfaacHeader), reinterpret_cast<char*>(buffer), _blockSize);
+				isRead = true;
+			} catch(std::runtime_error&) {
+				isRead = false;
+			}
+			// Keep the stream at the same position for other reads
+			_file.seekg(offset + sizeof(AartfaacHeader) + _blockSize, std::ios::beg);
+		}
+		else {
+			_file.read(reinterpret_cast<char*>(&h), sizeof(AartfaacHeader));
+			_file.read(reinterpret_cast<char*>(buffer), _blockSize);
+			isRead = bool(_file);
+		}
+		// One compare per timestep catches both damaged and misaligned data
+		if(!isRead || h.magic != AartfaacHeader::CORR_HDR_MAGIC)
+			return skipCorruptTimestep(buffer);
 		++_blockPos;
 		
-		return Timestep{TimeToCasa(h.startTime), TimeToCasa(h.endTime) };
+		return Timestep{TimeToCasa(h.startTime), TimeToCasa(h.endTime), true };
 	}
 	
+	/**
+	 * Times of the current timestep, without reading its data. Without an
+	 * index, the header is checked and searched for like in ReadTimestep(),
+	 * but the read position and timestep positions are left unchanged.
+	 */
 	Timestep ReadMetadata()
 	{
+		if(_hasIndex && _blockPos < _index.Size())
+			return indexedTimestep(_blockPos);
+		const int64_t offsetShift = _offsetShift;
 		AartfaacHeader h;
-		_file.read(reinterpret_cast<char*>(&h), sizeof(AartfaacHeader));
-		if(!_file)
-			throw std::runtime_error("Error reading file");
+		const bool isValid = readHeader(h);
+		_offsetShift = offsetShift;
+		_file.clear();
 		SeekToTimestep(_blockPos);
-		
-		return Timestep{TimeToCasa(h.startTime), TimeToCasa(h.endTime) };
+		if(isValid)
+			return Timestep{TimeToCasa(h.startTime), TimeToCasa(h.endTime), true };
+		else
+			return nominalTimestep(_blockPos);
+	}
+	
+	/**
+	 * Update the size of the file, which may have grown if it is still
+	 * being written. The read position is kept.
+	 */
+	void Refresh()
+	{
+		_file.clear();
+		const std::streampos position = _file.tellg();
+		_file.seekg(0, std::ios::end);
+		_filesize = _file.tellg();
+		_file.seekg(position);
+	}
+	
+	/**
+	 * Times of the given timestep. These are looked up in the index when
+	 * available; otherwise, the header is read from the file. The read
+	 * position is kept.
+	 */
+	Timestep TimestepMetadata(size_t timestep)
+	{
+		if(_hasIndex && timestep < _index.Size())
+			return indexedTimestep(timestep);
+		const size_t blockPos = _blockPos;
+		SeekToTimestep(timestep);
+		Timestep result = ReadMetadata();
+		SeekToTimestep(blockPos);
+		return result;
 	}
 	
+	/**
+	 * Create an index by reading the header of every timestep. Corrupt or
+	 * missing timesteps are handled like in ReadTimestep(), so the entries
+	 * and their offsets are the timesteps that the reader sees. Afterwards,
+	 * the file is positioned at the first timestep.
+	 */
+	AartfaacIndex BuildIndex()
+	{
+		AartfaacIndex index(_filesize);
+		// The positions should come from the file, not from an existing index
+		const bool hasIndex = _hasIndex;
+		_hasIndex = false;
+		_offsetShift = 0;
+		SeekToTimestep(0);
+		while(HasMore())
+		{
+			AartfaacHeader h;
+			const bool isValid = readHeader(h);
+			AartfaacIndex::Entry entry;
+			if(isValid)
+			{
+				entry.startTime = h.startTime;
+				entry.endTime = h.endTime;
+				entry.flags = AartfaacIndex::ValidHeaderFlag;
+			}
+			else {
+				entry.startTime = _header.startTime + _blockPos * IntegrationTime();
+				entry.endTime = entry.startTime + IntegrationTime();
+				entry.flags = 0;
+			}
+			entry.offset = TimestepOffset(_blockPos);
+			entry.reserved = 0;
+			index.Add(entry);
+			++_blockPos;
+		}
+		_hasIndex = hasIndex;
+		_offsetShift = hasIndex ? _index.OffsetShift(TimestepStride()) : 0;
+		_file.clear();
+		SeekToTimestep(0);
+		return index;
+	}
+	
+	/**
+	 * True when an up-to-date sidecar index was found for this file.
+	 */
+	bool HasIndex() const { return _hasIndex; }
+	
 	bool HasMore() const
 	{
-		return _blockPos < (_filesize / _blockSize);
+		return _blockPos < NTimesteps();
 	}
 	
+	/**
+	 * Number of complete timesteps in the file. A partial timestep at the end,
+	 * e.g. from a correlator that was interrupted while writing, is not counted.
+	 */
 	size_t NTimesteps() const
 	{
-		return _filesize / _blockSize;
+		const int64_t available = int64_t(_filesize) - _offsetShift;
+		return available > 0 ? size_t(available) / TimestepStride() : 0;
+	}
+	
+	/**
+	 * Number of bytes at the end of the file that do not form a complete timestep.
+	 */
+	size_t TrailingBytes() const
+	{
+		const int64_t available = int64_t(_filesize) - _offsetShift;
+		return available > 0 ? size_t(available) % TimestepStride() : 0;
 	}
 	
+	/**
+	 * Number of bytes per timestep, including its header.
+	 */
+	size_t TimestepStride() const { return sizeof(AartfaacHeader) + _blockSize; }
+	
+	/**
+	 * Byte position of a timestep in the file. This is taken from the index
+	 * when available. Otherwise, after skipping corrupt data, it includes the
+	 * shift of the data that follows it.
+	 */
+	uint64_t TimestepOffset(size_t timestep) const
+	{
+		if(_hasIndex && timestep < _index.Size())
+			return _index[timestep].offset;
+		return int64_t(timestep * TimestepStride()) + _offsetShift;
+	}
+	
+	const std::string& Filename() const { return _filename; }
+	
 	size_t VisPerTimestep() const
 	{
 		return _header.VisPerTimestep();
 	}
 	
-	size_t NChannels() const { return _header.nrChannels; }
+	/**
+	 * Select the channels start, start+step, ... up to (but not including) end.
+	 * After this, NChannels() and ChannelFrequency() refer to the selected
+	 * channels. ReadTimestep() still returns all channels in the file; use
+	 * ChannelIndexInFile() to find the selected channels in it.
+	 */
+	void SetChannelSelection(size_t start, size_t end, size_t step)
+	{
+		if(end == 0)
+			end = _header.nrChannels;
+		if(step == 0 || start >= end || end > _header.nrChannels)
+			throw std::runtime_error("Invalid channel selection: file has " + std::to_string(_header.nrChannels) + " channels");
+		_channelStart = start;
+		_channelEnd = end;
+		_channelStep = step;
+	}
+	
+	size_t NChannels() const { return (_channelEnd - _channelStart + _channelStep - 1) / _channelStep; }
+	size_t NChannelsInFile() const { return _header.nrChannels; }
+	size_t ChannelIndexInFile(size_t channel) const { return _channelStart + channel * _channelStep; }
 	size_t NAntennas() const { return _header.nrReceivers; }
 	uint8_t CorrelationMode() const { return _header.correlationMode; }
 	
 	double Bandwidth() const { return _bandwidth; }
 	double StartTime() const { return TimeToCasa(_header.startTime); }
 	double Frequency() const { return _frequency; }
+	double ChannelWidth() const { return _bandwidth / _header.nrChannels; }
+	double ChannelFrequency(size_t channel) const
+	{
+		return _frequency - _bandwidth*0.5 + ChannelWidth()*(0.5 + double(ChannelIndexInFile(channel)));
+	}
 	double IntegrationTime() const { return _header.endTime-_header.startTime; }
 	
 	/**
@@ -134,11 +359,205 @@ public:
 		return timestamp + ((2440587.5 - 2400000.5) * 86400.0);
 	}
 private:
+	void checkTrailingBytes(const char* filename)
+	{
+		const size_t trailing = TrailingBytes();
+		if(trailing != 0)
+			std::cout << "WARNING: " << filename << " ends with a partial timestep of " << trailing << " bytes, which is ignored.\n";
+	}
+	
+	void loadIndex(const char* filename)
+	{
+		_hasIndex = _index.Read(AartfaacIndex::Filename(filename));
+		if(_hasIndex && _index.FileSize() != _filesize)
+		{
+			std::cout << "Index of " << filename << " is out of date and is ignored.\n";
+			_hasIndex = false;
+		}
+		// Timesteps after the indexed ones follow the last indexed timestep
+		if(_hasIndex)
+			_offsetShift = _index.OffsetShift(TimestepStride());
+	}
+	
+	/**
+	 * Copy bytes from the file through the direct I/O buffer. The buffer is
+	 * refilled with one aligned read when the data is not in it.
+	 */
+	void readDirect(uint64_t offset, char* destination, size_t size)
+	{
+		while(size != 0)
+		{
+			if(offset < _directBufferOffset || offset >= _directBufferOffset + _directBufferFill)
+			{
+				_directBufferOffset = offset / directAlignment * directAlignment;
+				_directBufferFill = 0;
+				size_t fill = 0;
+				while(fill != _directBufferCapacity)
+				{
+					ssize_t result = pread(_directFd, &_directBuffer[fill], _directBufferCapacity - fill, _directBufferOffset + fill);
+					if(result < 0)
+						throw std::runtime_error(std::string("Error reading file: ") + std::strerror(errno));
+					fill += result;
+					// A short read that is not a multiple of the alignment is the end of the file
+					if(result == 0 || fill % directAlignment != 0)
+						break;
+				}
+				_directBufferFill = fill;
+				if(offset >= _directBufferOffset + _directBufferFill)
+					throw std::runtime_error("Error reading file");
+			}
+			const size_t bufferPos = offset - _directBufferOffset;
+			const size_t n = std::min(size, _directBufferFill - bufferPos);
+			std::copy_n(&_directBuffer[bufferPos], n, destination);
+			offset += n;
+			destination += n;
+			size -= n;
+		}
+	}
+	
+	/**
+	 * Called when the current timestep could not be read or has an invalid
+	 * header. The file is scanned for the next valid header, which is taken
+	 * to be the timestep closest to its position. Timestep positions from
+	 * there on are shifted accordingly, which handles lost as well as
+	 * inserted data. If the found header is of the current timestep, it is
+	 * read; otherwise, the current timestep is missing, so the buffer is
+	 * zeroed and the timestep is returned as invalid with its nominal times.
+	 */
+	Timestep skipCorruptTimestep(std::complex<float>* buffer)
+	{
+		AartfaacHeader h;
+		uint64_t headerOffset;
+		if(resync(h, headerOffset))
+		{
+			_file.clear();
+			_file.seekg(headerOffset + sizeof(AartfaacHeader), std::ios::beg);
+			_file.read(reinterpret_cast<char*>(buffer), _blockSize);
+			if(_file)
+			{
+				++_blockPos;
+				return Timestep{TimeToCasa(h.startTime), TimeToCasa(h.endTime), true };
+			}
+		}
+		
+		return missingTimestep(buffer);
+	}
+	
+	/**
+	 * Zero the buffer for a corrupt or missing timestep, and move on to the
+	 * next timestep. Returns the nominal times, marked as invalid.
+	 */
+	Timestep missingTimestep(std::complex<float>* buffer)
+	{
+		std::cout << "WARNING: Timestep " << _blockPos << " of " << _filename << " is corrupt or missing and will be flagged.\n";
+		std::fill_n(buffer, _header.VisPerTimestep(), std::complex<float>());
+		const Timestep result = nominalTimestep(_blockPos);
+		++_blockPos;
+		_file.clear();
+		_file.seekg(TimestepOffset(_blockPos), std::ios::beg);
+		return result;
+	}
+	
+	Timestep nominalTimestep(size_t timestep) const
+	{
+		const double startTime = StartTime() + timestep * IntegrationTime();
+		return Timestep{startTime, startTime + IntegrationTime(), false };
+	}
+	
+	/**
+	 * Read the header of the current timestep. When it is not valid, the
+	 * file is searched with resync(). Returns true when a valid header of
+	 * the current timestep was found.
+	 */
+	bool readHeader(AartfaacHeader& header)
+	{
+		_file.clear();
+		_file.seekg(TimestepOffset(_blockPos), std::ios::beg);
+		_file.read(reinterpret_cast<char*>(&header), sizeof(AartfaacHeader));
+		if(_file && header.magic == AartfaacHeader::CORR_HDR_MAGIC)
+			return true;
+		uint64_t headerOffset;
+		return resync(header, headerOffset);
+	}
+	
+	/**
+	 * Find the next valid header for the current timestep or a later one, and
+	 * shift the positions of the following timesteps to it. Returns true, with
+	 * the header and its position, when the found header is of the current
+	 * timestep.
+	 */
+	bool resync(AartfaacHeader& header, uint64_t& headerOffset)
+	{
+		const size_t stride = TimestepStride();
+		// Search from just after the header of the previous timestep
+		uint64_t searchStart = _blockPos == 0 ? 1 : TimestepOffset(_blockPos-1) + sizeof(AartfaacHeader);
+		while(findHeader(searchStart, headerOffset, header))
+		{
+			const int64_t index = int64_t(_blockPos) + std::llround((double(headerOffset) - double(TimestepOffset(_blockPos))) / stride);
+			if(index >= int64_t(_blockPos))
+			{
+				_offsetShift = int64_t(headerOffset) - index * int64_t(stride);
+				return index == int64_t(_blockPos);
+			}
+			searchStart = headerOffset + 1;
+		}
+		return false;
+	}
+	
+	/**
+	 * Scan the file from the given position for the next header that
+	 * matches the first header of the file.
+	 */
+	bool findHeader(uint64_t start, uint64_t& headerOffset, AartfaacHeader& header)
+	{
+		const size_t scanSize = 1024*1024;
+		const uint32_t magic = AartfaacHeader::CORR_HDR_MAGIC;
+		std::vector<char> data(scanSize + sizeof(AartfaacHeader));
+		for(uint64_t position = start; position < _filesize; position += scanSize)
+		{
+			_file.clear();
+			_file.seekg(position, std::ios::beg);
+			_file.read(data.data(), data.size());
+			const size_t n = _file.gcount();
+			for(size_t i=0; i!=scanSize && i + sizeof(AartfaacHeader) <= n; ++i)
+			{
+				if(std::memcmp(&data[i], &magic, sizeof(magic)) == 0)
+				{
+					std::memcpy(&header, &data[i], sizeof(AartfaacHeader));
+					if(header.nrReceivers == _header.nrReceivers && header.nrChannels == _header.nrChannels &&
+						header.nrPolarizations == _header.nrPolarizations && header.correlationMode == _header.correlationMode)
+					{
+						headerOffset = position + i;
+						return true;
+					}
+				}
+			}
+		}
+		return false;
+	}
+	
+	Timestep indexedTimestep(size_t timestep) const
+	{
+		return Timestep{TimeToCasa(_index[timestep].startTime), TimeToCasa(_index[timestep].endTime), _index[timestep].IsValid() };
+	}
+	
+	static const size_t directAlignment = 4096, directReadSize = 32*1024*1024;
+	
 	std::ifstream _file;
+	std::string _filename;
 	AartfaacHeader _header;
 	AartfaacMode _mode;
 	size_t _blockSize, _filesize, _blockPos, _sbIndex;
+	int64_t _offsetShift;
+	size_t _channelStart, _channelEnd, _channelStep;
 	double _frequency, _bandwidth;
+	AartfaacIndex _index;
+	bool _hasIndex;
+	int _directFd;
+	aligned_ptr<char> _directBuffer;
+	size_t _directBufferCapacity;
+	uint64_t _directBufferOffset;
+	size_t _directBufferFill;
 };
 
 #endif
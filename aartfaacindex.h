@@ -0,0 +1,130 @@
+#ifndef AARTFAAC_INDEX_H
+#define AARTFAAC_INDEX_H
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Sidecar index of an AARTFAAC file, which lists the times and byte offset
+ * of every timestep. It is stored next to the file, with ".idx" appended to
+ * the filename. With an index, timestep times can be looked up without
+ * reading the timestep headers from the (possibly very large) file.
+ *
+ * The index file has a 32 byte header, followed by one 32 byte entry per
+ * timestep. All values are little endian.
+ */
+class AartfaacIndex
+{
+public:
+	enum EntryFlags {
+		// The timestep header has the correct magic number
+		ValidHeaderFlag = 1
+	};
+	
+	struct Entry
+	{
+		// Times as stored in the header of the timestep (so not in CASA time)
+		double startTime, endTime;
+		uint64_t offset;
+		uint32_t flags;
+		uint32_t reserved;
+		
+		bool IsValid() const { return (flags & ValidHeaderFlag) != 0; }
+	};
+	
+	AartfaacIndex() : _fileSize(0) { }
+	
+	/**
+	 * Create an empty index for a file of the given size. Entries are added
+	 * with Add(); AartfaacFile::BuildIndex() fills an index this way.
+	 */
+	explicit AartfaacIndex(uint64_t fileSize) : _fileSize(fileSize) { }
+	
+	static std::string Filename(const std::string& aartfaacFilename)
+	{
+		return aartfaacFilename + ".idx";
+	}
+	
+	void Write(const std::string& indexFilename) const
+	{
+		std::ofstream file(indexFilename, std::ios::binary);
+		const uint64_t nEntries = _entries.size();
+		const uint32_t fileVersion = version, reserved = 0;
+		file.write(magic, 8);
+		file.write(reinterpret_cast<const char*>(&fileVersion), sizeof(fileVersion));
+		file.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+		file.write(reinterpret_cast<const char*>(&_fileSize), sizeof(_fileSize));
+		file.write(reinterpret_cast<const char*>(&nEntries), sizeof(nEntries));
+		file.write(reinterpret_cast<const char*>(_entries.data()), sizeof(Entry) * _entries.size());
+		if(!file)
+			throw std::runtime_error("Error writing index file " + indexFilename);
+	}
+	
+	/**
+	 * Read an index file. Returns false if there is no (readable) index.
+	 */
+	bool Read(const std::string& indexFilename)
+	{
+		std::ifstream file(indexFilename, std::ios::binary);
+		if(!file)
+			return false;
+		file.seekg(0, std::ios::end);
+		const uint64_t indexFileSize = file.tellg();
+		file.seekg(0, std::ios::beg);
+		char fileMagic[8];
+		uint32_t fileVersion, reserved;
+		uint64_t nEntries;
+		file.read(fileMagic, 8);
+		file.read(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion));
+		file.read(reinterpret_cast<char*>(&reserved), sizeof(reserved));
+		file.read(reinterpret_cast<char*>(&_fileSize), sizeof(_fileSize));
+		file.read(reinterpret_cast<char*>(&nEntries), sizeof(nEntries));
+		if(!file || std::string(fileMagic, 8) != std::string(magic, 8) || fileVersion != version)
+			return false;
+		// The entry count should match the size, so that a damaged count is not allocated
+		if(indexFileSize < headerSize || nEntries != (indexFileSize - headerSize) / sizeof(Entry))
+			return false;
+		_entries.resize(nEntries);
+		file.read(reinterpret_cast<char*>(_entries.data()), sizeof(Entry) * _entries.size());
+		return bool(file);
+	}
+	
+	/**
+	 * Size of the indexed file at the time the index was built. An index is
+	 * out of date when this differs from the current size of the file.
+	 */
+	uint64_t FileSize() const { return _fileSize; }
+	
+	size_t Size() const { return _entries.size(); }
+	
+	void Add(const Entry& entry) { _entries.push_back(entry); }
+	
+	const Entry& operator[](size_t timestep) const { return _entries[timestep]; }
+	
+	/**
+	 * Difference between the offset of the last timestep and its nominal
+	 * offset, i.e. its index times the stride. Timesteps after the indexed
+	 * ones are expected at this shift.
+	 */
+	int64_t OffsetShift(uint64_t stride) const
+	{
+		if(_entries.empty())
+			return 0;
+		return int64_t(_entries.back().offset) - int64_t((_entries.size()-1) * stride);
+	}
+
+private:
+	static constexpr const char* magic = "AFINDEX1";
+	static const uint32_t version = 1;
+	static const uint64_t headerSize = 32;
+	
+	uint64_t _fileSize;
+	std::vector<Entry> _entries;
+};
+
+static_assert(sizeof(AartfaacIndex::Entry) == 32, "Index entries should be of size 32 bytes");
+
+#endif
@@ -1,19 +1,35 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "aartfaacfile.h"
 #include "aartfaacheader.h"
+#include "aartfaacindex.h"
+#include "filecopy.h"
 #include "optional.h"
+#include "partfilename.h"
 #include "timerange.h"
 
 #include "units/radeccoord.h"
 
+#include <aocommon/parallelfor.h>
+
 #include <casacore/measures/Measures/MCEpoch.h>
 #include <casacore/measures/Measures/MeasConvert.h>
 #include <casacore/measures/Measures/MEpoch.h>
 #include <casacore/casa/Quanta/MVTime.h>
 #include <casacore/measures/Measures/MPosition.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 
 // Convert casacore time to ISO 8601 format
 std::string TimeToString(const casacore::MVTime& time)
@@ -34,13 +50,281 @@ double StringToEpoch(const std::string& datestring)
 	return casacore::MEpoch(mytime_q, casacore::MEpoch::UTC).getValue().getTime("s").getValue();
 }
 
+// Central time of a timestep, in casacore time (seconds)
+double CentralTime(AartfaacFile& file, size_t timestep)
+{
+	Timestep t = file.TimestepMetadata(timestep);
+	return (t.startTime + t.endTime) * 0.5;
+}
+
+// Local apparent sidereal time at AARTFAAC in hours
+double TimeToLst(double time, const casacore::MeasFrame& frame)
+{
+	casacore::MEpoch timeEpoch = casacore::MEpoch(casacore::MVEpoch(time/86400.0), casacore::MEpoch::UTC);
+	casacore::MEpoch lst = casacore::MEpoch::Convert(timeEpoch, casacore::MEpoch::Ref(casacore::MEpoch::LAST, frame))();
+	return lst.getValue().getDayFraction() * 24.0;
+}
+
+// Wrap an LST in hours to [0, 24)
+double WrapLst(double lst)
+{
+	const double wrapped = std::fmod(lst, 24.0);
+	return wrapped < 0.0 ? wrapped + 24.0 : wrapped;
+}
+
+// First timestep in [start, end) for which the predicate is true, given that it
+// is false for all timesteps before and true for all timesteps after that one.
+template<typename Predicate>
+size_t FindFirstTimestep(size_t start, size_t end, Predicate predicate)
+{
+	while(start != end)
+	{
+		const size_t mid = start + (end - start) / 2;
+		if(predicate(mid))
+			end = mid;
+		else
+			start = mid + 1;
+	}
+	return start;
+}
+
+/**
+ * The LST of timesteps, 'unwrapped' so that it keeps increasing past 24h.
+ * It is estimated from the sidereal rate and a reference timestep, which needs
+ * only one exact (and slow) conversion.
+ */
+class UnwrappedLst
+{
+public:
+	UnwrappedLst(AartfaacFile& file, size_t referenceTimestep, const casacore::MeasFrame& frame) :
+		_file(file),
+		_frame(frame),
+		_referenceTime(CentralTime(file, referenceTimestep)),
+		_referenceLst(TimeToLst(_referenceTime, frame))
+	{ }
+
+	double Estimate(size_t timestep)
+	{
+		const double siderealRate = 1.00273790935;
+		return _referenceLst + (CentralTime(_file, timestep) - _referenceTime) * siderealRate / 3600.0;
+	}
+
+	double Exact(size_t timestep)
+	{
+		const double estimate = Estimate(timestep);
+		double difference = TimeToLst(CentralTime(_file, timestep), _frame) - estimate;
+		difference -= 24.0 * std::round(difference / 24.0);
+		return estimate + difference;
+	}
+
+	/**
+	 * First timestep in [start, end) with an LST of at least the given (unwrapped)
+	 * LST. The estimate is refined with a few exact conversions.
+	 */
+	size_t FindFirst(size_t start, size_t end, double lst)
+	{
+		size_t timestep = FindFirstTimestep(start, end, [&](size_t t) { return Estimate(t) >= lst; });
+		while(timestep > start && Exact(timestep-1) >= lst)
+			--timestep;
+		while(timestep < end && Exact(timestep) < lst)
+			++timestep;
+		return timestep;
+	}
+
+private:
+	AartfaacFile& _file;
+	const casacore::MeasFrame& _frame;
+	double _referenceTime, _referenceLst;
+};
+
+// Copy a byte range of a file to a new file
+void CopyToFile(const std::string& inputFilename, uint64_t offset, uint64_t count, const std::string& outputFilename)
+{
+	int inFd = open(inputFilename.c_str(), O_RDONLY);
+	if(inFd < 0)
+		throw std::runtime_error("Error opening input file " + inputFilename);
+	int outFd = open(outputFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(outFd < 0)
+	{
+		close(inFd);
+		throw std::runtime_error("Error opening output file " + outputFilename);
+	}
+	try {
+		CopyFileRange(inFd, offset, outFd, 0, count);
+	} catch(...) {
+		close(inFd);
+		close(outFd);
+		throw;
+	}
+	close(inFd);
+	if(close(outFd) != 0)
+		throw std::runtime_error("Error writing output file " + outputFilename);
+}
+
+// Read the header of a timestep at the given byte offset
+AartfaacHeader ReadHeader(int fd, uint64_t offset, const std::string& filename)
+{
+	AartfaacHeader header;
+	if(pread(fd, &header, sizeof(AartfaacHeader), offset) != sizeof(AartfaacHeader))
+		throw std::runtime_error("Error reading header from " + filename);
+	if(header.magic != AartfaacHeader::CORR_HDR_MAGIC)
+		throw std::runtime_error("Invalid timestep header in " + filename);
+	return header;
+}
+
+// Read count bytes at the given offset, or throw
+void ReadFully(int fd, char* buffer, size_t count, uint64_t offset, const std::string& filename)
+{
+	while(count != 0)
+	{
+		ssize_t result = pread(fd, buffer, count, offset);
+		if(result <= 0)
+			throw std::runtime_error("Error reading " + filename);
+		buffer += result;
+		count -= result;
+		offset += result;
+	}
+}
+
+/**
+ * Check that a merged file is the concatenation of the input files. The size
+ * is always checked; with compareContent, the data is compared as well.
+ */
+void VerifyMerge(const std::vector<int>& inFds, const std::vector<std::string>& inputFilenames, const std::vector<uint64_t>& sizes, const std::vector<uint64_t>& outputOffsets, const std::string& outputFilename, bool compareContent)
+{
+	int outFd = open(outputFilename.c_str(), O_RDONLY);
+	if(outFd < 0)
+		throw std::runtime_error("Error opening output file " + outputFilename);
+	try {
+		struct stat fileStat;
+		if(fstat(outFd, &fileStat) != 0)
+			throw std::runtime_error("Error reading output file " + outputFilename);
+		if(uint64_t(fileStat.st_size) != outputOffsets.back())
+		{
+			std::ostringstream str;
+			str << "Merged file " << outputFilename << " has a size of " << fileStat.st_size << " bytes, while the input files have a total size of " << outputOffsets.back() << " bytes";
+			throw std::runtime_error(str.str());
+		}
+		if(compareContent)
+		{
+			std::cout << "Comparing merged file with the input files...\n";
+			const size_t bufferSize = 16*1024*1024;
+			std::vector<char> inBuffer(bufferSize), outBuffer(bufferSize);
+			for(size_t i=0; i!=inFds.size(); ++i)
+			{
+				for(uint64_t position = 0; position < sizes[i]; position += bufferSize)
+				{
+					const size_t count = std::min<uint64_t>(bufferSize, sizes[i] - position);
+					ReadFully(inFds[i], inBuffer.data(), count, position, inputFilenames[i]);
+					ReadFully(outFd, outBuffer.data(), count, outputOffsets[i] + position, outputFilename);
+					if(std::memcmp(inBuffer.data(), outBuffer.data(), count) != 0)
+						throw std::runtime_error("Merged file " + outputFilename + " differs from input file " + inputFilenames[i]);
+				}
+			}
+		}
+	} catch(...) {
+		close(outFd);
+		throw;
+	}
+	close(outFd);
+}
+
+/**
+ * Concatenate files in time. The files should have the same format, and every
+ * file should start one integration time after the end of the previous one.
+ */
+void Merge(const std::vector<std::string>& inputFilenames, const std::string& outputFilename, bool verify)
+{
+	std::vector<int> inFds;
+	std::vector<uint64_t> sizes, outputOffsets(1, 0);
+	AartfaacHeader first, previousLast;
+	try {
+		for(size_t i=0; i!=inputFilenames.size(); ++i)
+		{
+			const std::string& filename = inputFilenames[i];
+			int fd = open(filename.c_str(), O_RDONLY);
+			if(fd < 0)
+				throw std::runtime_error("Error opening input file " + filename);
+			inFds.emplace_back(fd);
+			struct stat fileStat;
+			if(fstat(fd, &fileStat) != 0)
+				throw std::runtime_error("Error reading input file " + filename);
+
+			AartfaacHeader header = ReadHeader(fd, 0, filename);
+			header.Check();
+			const uint64_t stride = sizeof(AartfaacHeader) + sizeof(std::complex<float>) * header.VisPerTimestep();
+			const uint64_t size = fileStat.st_size;
+			if(size == 0 || size % stride != 0)
+				throw std::runtime_error("File " + filename + " does not consist of whole timesteps");
+			if(i == 0)
+			{
+				first = header;
+			}
+			else {
+				if(header.nrReceivers != first.nrReceivers || header.nrChannels != first.nrChannels ||
+					header.nrPolarizations != first.nrPolarizations || header.correlationMode != first.correlationMode)
+					throw std::runtime_error("File " + filename + " has a different format than " + inputFilenames.front());
+				const double
+					integrationTime = previousLast.endTime - previousLast.startTime,
+					gap = header.startTime - previousLast.endTime;
+				if(std::fabs(gap) > 0.5 * integrationTime)
+				{
+					std::ostringstream str;
+					str << "File " << filename << " does not continue where " << inputFilenames[i-1] << " ends: gap is " << gap << " s";
+					throw std::runtime_error(str.str());
+				}
+			}
+			previousLast = ReadHeader(fd, size - stride, filename);
+			sizes.emplace_back(size);
+			outputOffsets.emplace_back(outputOffsets.back() + size);
+		}
+
+		int outFd = open(outputFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(outFd < 0)
+			throw std::runtime_error("Error opening output file " + outputFilename);
+		// Every file has its own place in the output, so they are copied in parallel
+		std::vector<std::thread> threads;
+		std::vector<std::exception_ptr> errors(inFds.size());
+		for(size_t i=0; i!=inFds.size(); ++i)
+		{
+			threads.emplace_back([&, i]() {
+				try {
+					CopyFileRange(inFds[i], 0, outFd, outputOffsets[i], sizes[i]);
+				} catch(...) {
+					errors[i] = std::current_exception();
+				}
+			});
+		}
+		for(std::thread& thread : threads)
+			thread.join();
+		const bool closeFailed = close(outFd) != 0;
+		for(std::exception_ptr& error : errors)
+		{
+			if(error)
+				std::rethrow_exception(error);
+		}
+		if(closeFailed)
+			throw std::runtime_error("Error writing output file " + outputFilename);
+		VerifyMerge(inFds, inputFilenames, sizes, outputOffsets, outputFilename, verify);
+	} catch(...) {
+		for(int fd : inFds)
+			close(fd);
+		throw;
+	}
+	for(int fd : inFds)
+		close(fd);
+	std::cout << "Merged " << inputFilenames.size() << " files into " << outputFilename << ".\n";
+}
+
 int main(int argc, char* argv[])
 {
 	int argi = 1;
 	Optional<size_t> intervalStart, intervalEnd;
 	Optional<double> lstStart, lstEnd;
 	Optional<double> utcStart, utcEnd;
-	bool showLst = false;
+	bool showLst = false, buildIndex = false, inPlace = false, merge = false, verify = false;
+	size_t splitCount = 0;
+	double splitSeconds = 0.0;
 
 	while(argi < argc && argv[argi][0] == '-')
 	{
@@ -79,13 +363,39 @@ int main(int argc, char* argv[])
 		{
 			showLst = true;
 		}
+		else if(p == "build-index")
+		{
+			buildIndex = true;
+		}
+		else if(p == "in-place")
+		{
+			inPlace = true;
+		}
+		else if(p == "split")
+		{
+			++argi;
+			splitCount = atoi(argv[argi]);
+		}
+		else if(p == "split-seconds")
+		{
+			++argi;
+			splitSeconds = atof(argv[argi]);
+		}
+		else if(p == "merge")
+		{
+			merge = true;
+		}
+		else if(p == "verify")
+		{
+			verify = true;
+		}
 		else {
 			std::cerr << "Invalid parameter -" << p << '\n';
 			return 1;
 		}
 		++argi;
 	}
-	if((argi+2 > argc && !showLst) || argi+1 > argc )
+	if((argi+2 > argc && !showLst && !buildIndex && !inPlace) || argi+1 > argc )
 	{
 		std::cerr <<
 			"Syntax: afedit [options] <input filename> [<output filename>]\n"
@@ -96,11 +406,49 @@ int main(int argc, char* argv[])
 			"  -lst-end <end lst>\n"
 			"  -utc-start <start utc>\n"
 			"  -utc-end <end utc>\n"
-			"  -show-lst <lst>\n";
+			"  -show-lst <lst>\n"
+			"  -build-index\n"
+			"\tWrite an index of the timestep times next to the input file, which makes\n"
+			"\tlater time selections on the file faster.\n"
+			"  -in-place\n"
+			"\tTrim the input file itself instead of writing an output file. When the selection\n"
+			"\tstarts at a file system block boundary, its start and end are cut off in place.\n"
+			"\tOtherwise, the selection is copied to a temporary file next to the input file,\n"
+			"\twhich then replaces the input file.\n"
+			"  -split <count>\n"
+			"\tSplit the (selected) timesteps into the given number of files. Output files\n"
+			"\tare named after the output filename, e.g. out-part000.vis for out.vis.\n"
+			"  -split-seconds <seconds>\n"
+			"\tLike -split, but split into files of the given duration.\n"
+			"  -merge\n"
+			"\tConcatenate the input files, given in order of time, into the output file:\n"
+			"\tafedit -merge <input1> <input2> [...] <output>\n"
+			"  -verify\n"
+			"\tWith -merge, compare the merged file with the input files after writing it.\n";
 	}
 	const char *inputFilename(argv[argi]);
+
+	if(merge)
+	{
+		if(argi+3 > argc)
+			throw std::runtime_error("-merge needs at least two input files and an output file");
+		Merge(std::vector<std::string>(argv + argi, argv + argc - 1), argv[argc-1], verify);
+		return 0;
+	}
+
+	if(inPlace && (splitCount != 0 || splitSeconds != 0.0))
+		throw std::runtime_error("-in-place can not be combined with -split");
+
+	if(buildIndex)
+	{
+		AartfaacIndex index = AartfaacFile(inputFilename).BuildIndex();
+		index.Write(AartfaacIndex::Filename(inputFilename));
+		std::cout << "Wrote index of " << index.Size() << " timesteps to " << AartfaacIndex::Filename(inputFilename) << ".\n";
+		return 0;
+	}
+
 	const char *outputFilename;
-	if(showLst)
+	if(showLst || inPlace)
 		outputFilename = nullptr;
 	else
 		outputFilename = argv[argi+1];
@@ -111,51 +459,51 @@ int main(int argc, char* argv[])
 		casacore::MPosition aartfaacPos(casacore::MVPosition(3826577.022720000, 461022.995082000, 5064892.814), casacore::MPosition::ITRF);
 		casacore::MeasFrame frame(aartfaacPos);
 		TimeRange lstRange(lstStart.ValueOr(0.0), lstEnd.ValueOr(24.0));
-		TimeRange utcRange(utcStart.ValueOr(0.0), utcEnd.ValueOr(1e12));
-		size_t selectionStartIndex = file.NTimesteps(), selectionEndIndex = 0;
-		double firstLst = 0.0, lastLst = 0.0;
-		casacore::MVTime firstUtc, lastUtc;
 
 		size_t
 			tStart = intervalStart.ValueOr(0),
 			tEnd = intervalEnd.ValueOr(file.NTimesteps());
-
-		// TODO this could be done with binary search to make it faster
-		for(size_t timestep=tStart; timestep!=tEnd; ++timestep)
-		{
-			file.SeekToTimestep(timestep);
-			Timestep t = file.ReadMetadata();
-			double obsTime = (t.startTime + t.endTime) * 0.5;
-			casacore::MEpoch timeEpoch = casacore::MEpoch(casacore::MVEpoch(obsTime/86400.0), casacore::MEpoch::UTC);
-			double timeEpochValue = timeEpoch.getValue().getTime("s").getValue();
-			casacore::MEpoch lst = casacore::MEpoch::Convert(timeEpoch, casacore::MEpoch::Ref(casacore::MEpoch::LAST, frame))();
-			double hour = lst.getValue().getDayFraction() * 24.0;
-			if(lstRange.Contains(hour) && utcRange.Contains(timeEpochValue))
-			{
-				if(selectionStartIndex == file.NTimesteps())
-					selectionStartIndex = timestep;
-				selectionEndIndex = timestep;
-			}
-			if(timestep == tStart)
-			{
-				firstLst = hour;
-				firstUtc = timeEpoch.getValue();
-			}
-			if(timestep+1 == tEnd) {
-				lastLst = hour;
-				lastUtc = timeEpoch.getValue();
-			}
+		if(tStart >= tEnd)
+		{
+			std::cerr << "Invalid trimming interval.\n";
+			return 1;
 		}
+
+		const double firstTime = CentralTime(file, tStart), lastTime = CentralTime(file, tEnd-1);
+		const double firstLst = TimeToLst(firstTime, frame), lastLst = TimeToLst(lastTime, frame);
+		const casacore::MVTime
+			firstUtc(casacore::MVEpoch(firstTime/86400.0)),
+			lastUtc(casacore::MVEpoch(lastTime/86400.0));
 		std::cout << "UTC range of observation: " << TimeToString(firstUtc) << " - " << TimeToString(lastUtc) << ".\n";
 		std::cout << "LST range of observation: " << RaDecCoord::RAToString(firstLst*(M_PI/12.0)) << " - " << RaDecCoord::RAToString(lastLst*(M_PI/12.0)) << " (in hours: " << firstLst << " - " << lastLst << ").\n";
 		if(showLst)
 			return 0;
-		if(selectionStartIndex == file.NTimesteps())
+
+		// Timestep times increase monotonously, so the selection can be found
+		// with binary searches.
+		size_t selectionStartIndex = tStart, selectionEndIndex = tEnd;
+		if(utcStart.HasValue())
+			selectionStartIndex = FindFirstTimestep(tStart, tEnd, [&](size_t timestep) { return CentralTime(file, timestep) >= *utcStart; });
+		if(utcEnd.HasValue())
+			selectionEndIndex = FindFirstTimestep(selectionStartIndex, tEnd, [&](size_t timestep) { return CentralTime(file, timestep) >= *utcEnd; });
+		if(selectionStartIndex < selectionEndIndex && (lstStart.HasValue() || lstEnd.HasValue()))
+		{
+			UnwrappedLst lst(file, selectionStartIndex, frame);
+			const double
+				startLst = lst.Exact(selectionStartIndex),
+				endLst = lst.Exact(selectionEndIndex-1);
+			// Move the start forward to where the LST first enters the range, and
+			// the end back to where it last leaves the range.
+			if(!lstRange.Contains(WrapLst(startLst)))
+				selectionStartIndex = lst.FindFirst(selectionStartIndex, selectionEndIndex, startLst + WrapLst(lstStart.ValueOr(0.0) - startLst));
+			if(!lstRange.Contains(WrapLst(endLst)))
+				selectionEndIndex = lst.FindFirst(selectionStartIndex, selectionEndIndex, endLst - WrapLst(endLst - lstEnd.ValueOr(24.0)));
+		}
+		if(selectionStartIndex >= selectionEndIndex)
 		{
 			std::cerr << "File has no timesteps in given interval.\n";
 			return 1;
 		}
-		++selectionEndIndex;
 		std::cout << "Selected timesteps from interval: " << selectionStartIndex << " - " << selectionEndIndex << '\n';
 		intervalStart = selectionStartIndex;
 		intervalEnd = selectionEndIndex;
@@ -175,8 +523,10 @@ int main(int argc, char* argv[])
 	inFile.seekg(0, std::ios::beg);
 	inFile.read(reinterpret_cast<char*>(&header), sizeof(AartfaacHeader));
 	header.Check();
-	size_t blockSize = sizeof(std::complex<float>) * header.VisPerTimestep();
-	size_t timesteps = filesize / blockSize;
+	const size_t stride = sizeof(AartfaacHeader) + sizeof(std::complex<float>) * header.VisPerTimestep();
+	size_t timesteps = filesize / stride;
+	if(filesize % stride != 0)
+		std::cout << "WARNING: " << inputFilename << " ends with a partial timestep of " << (filesize % stride) << " bytes, which is ignored.\n";
 
 	if(!intervalStart.HasValue())
 		intervalStart = 0;
@@ -188,23 +538,54 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	// Copy the interval
-	std::ofstream outFile(outputFilename);
-	std::vector<char> block(sizeof(AartfaacHeader) + blockSize);
-	inFile.seekg(block.size() * (*intervalStart), std::ios::beg);
-	for(size_t timestep = *intervalStart; timestep != *intervalEnd; ++timestep)
+	// The interval is one contiguous byte range
+	const uint64_t
+		startOffset = stride * (*intervalStart),
+		endOffset = stride * (*intervalEnd);
+	inFile.close();
+	if(inPlace)
 	{
-		inFile.read(block.data(), block.size());
-		if(!inFile)
+		TrimFileInPlace(inputFilename, startOffset, endOffset);
+	}
+	else if(splitCount != 0 || splitSeconds != 0.0)
+	{
+		const size_t nTimesteps = *intervalEnd - *intervalStart;
+		// With -split-seconds, every part but the last has exactly partSize timesteps
+		size_t partSize = 0;
+		if(splitCount == 0)
 		{
-			std::cerr << "Error reading input file.\n";
-			return 1;
+			partSize = std::max<size_t>(1, std::ceil(splitSeconds / (header.endTime - header.startTime)));
+			splitCount = (nTimesteps + partSize - 1) / partSize;
 		}
-		outFile.write(block.data(), block.size());
-		if(!outFile)
+		splitCount = std::min(splitCount, nTimesteps);
+		// Returns the first timestep of a part, relative to the selection
+		auto partStartTimestep = [&](size_t part) -> size_t {
+			if(partSize == 0)
+				return nTimesteps * part / splitCount;
+			else
+				return std::min(part * partSize, nTimesteps);
+		};
+		const size_t nThreads = std::max<size_t>(1, std::min<size_t>(splitCount, std::thread::hardware_concurrency()));
+		std::cout << "Splitting " << nTimesteps << " timesteps into " << splitCount << " files, using " << nThreads << " threads.\n";
+		std::vector<std::exception_ptr> errors(splitCount);
+		aocommon::ParallelFor<size_t> parallelFor(nThreads);
+		parallelFor.Run(0, splitCount, [&](size_t part, size_t) {
+			const uint64_t
+				partStart = startOffset + stride * partStartTimestep(part),
+				partEnd = startOffset + stride * partStartTimestep(part + 1);
+			try {
+				CopyToFile(inputFilename, partStart, partEnd - partStart, PartFilename(outputFilename, part));
+			} catch(...) {
+				errors[part] = std::current_exception();
+			}
+		});
+		for(std::exception_ptr& error : errors)
 		{
-			std::cerr << "Error writing output file.\n";
-			return 1;
+			if(error)
+				std::rethrow_exception(error);
 		}
 	}
+	else {
+		CopyToFile(inputFilename, startOffset, endOffset - startOffset, outputFilename);
+	}
 }
@@ -0,0 +1,241 @@
+#include "asyncreader.h"
+
+#include <aocommon/lane.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace {
+
+int openFile(const std::string& filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Could not open " + filename + ": " + std::strerror(errno));
+	return fd;
+}
+
+/**
+ * Does blocking reads from a pool of threads, one read per thread at a time.
+ */
+class ThreadPoolReader final : public AsyncReader
+{
+public:
+	ThreadPoolReader(const std::string& filename, size_t queueDepth) :
+		_fd(openFile(filename)),
+		_requests(queueDepth),
+		_slots(queueDepth)
+	{
+		for(size_t i=0; i!=queueDepth; ++i)
+			_threads.emplace_back(&ThreadPoolReader::readThreadFunc, this);
+	}
+	
+	~ThreadPoolReader()
+	{
+		_requests.write_end();
+		for(std::thread& thread : _threads)
+			thread.join();
+		close(_fd);
+	}
+	
+	virtual void Submit(size_t slot, uint64_t offset, char* destination, size_t size) final override
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_slots[slot].isFinished = false;
+			_slots[slot].error = std::exception_ptr();
+		}
+		_requests.write(Request{slot, offset, destination, size});
+	}
+	
+	virtual void Wait(size_t slot) final override
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while(!_slots[slot].isFinished)
+			_finishedCondition.wait(lock);
+		if(_slots[slot].error)
+			std::rethrow_exception(_slots[slot].error);
+	}
+	
+private:
+	struct Request
+	{
+		size_t slot;
+		uint64_t offset;
+		char* destination;
+		size_t size;
+	};
+	struct Slot
+	{
+		Slot() : isFinished(true) { }
+		bool isFinished;
+		std::exception_ptr error;
+	};
+	
+	void readThreadFunc()
+	{
+		Request request;
+		while(_requests.read(request))
+		{
+			std::exception_ptr error;
+			try {
+				size_t position = 0;
+				while(position != request.size)
+				{
+					ssize_t result = pread(_fd, request.destination + position, request.size - position, request.offset + position);
+					if(result < 0)
+						throw std::runtime_error(std::string("Error reading file: ") + std::strerror(errno));
+					if(result == 0)
+						throw std::runtime_error("Error reading file: unexpected end of file");
+					position += result;
+				}
+			} catch(...) {
+				error = std::current_exception();
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			_slots[request.slot].isFinished = true;
+			_slots[request.slot].error = error;
+			_finishedCondition.notify_all();
+		}
+	}
+	
+	int _fd;
+	aocommon::Lane<Request> _requests;
+	std::vector<Slot> _slots;
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _finishedCondition;
+};
+
+#ifdef HAVE_LIBURING
+/**
+ * Keeps all reads in flight in one io_uring, from the calling thread.
+ */
+class UringReader final : public AsyncReader
+{
+public:
+	UringReader(const std::string& filename, size_t queueDepth) :
+		_fd(openFile(filename)),
+		_slots(queueDepth)
+	{
+		int result = io_uring_queue_init(queueDepth, &_ring, 0);
+		if(result < 0)
+		{
+			close(_fd);
+			throw std::runtime_error(std::string("Could not initialize io_uring: ") + std::strerror(-result));
+		}
+	}
+	
+	~UringReader()
+	{
+		// Outstanding reads still write into the slot buffers, so finish them
+		try {
+			for(size_t slot=0; slot!=_slots.size(); ++slot)
+			{
+				while(_slots[slot].isPending)
+					reapCompletion();
+			}
+		} catch(std::exception&) {
+		}
+		io_uring_queue_exit(&_ring);
+		close(_fd);
+	}
+	
+	virtual void Submit(size_t slot, uint64_t offset, char* destination, size_t size) final override
+	{
+		Slot& s = _slots[slot];
+		s.offset = offset;
+		s.destination = destination;
+		s.size = size;
+		s.position = 0;
+		s.error.clear();
+		queueRead(slot);
+		io_uring_submit(&_ring);
+	}
+	
+	virtual void Wait(size_t slot) final override
+	{
+		while(_slots[slot].isPending)
+			reapCompletion();
+		if(!_slots[slot].error.empty())
+			throw std::runtime_error(_slots[slot].error);
+	}
+	
+private:
+	struct Slot
+	{
+		Slot() : isPending(false) { }
+		uint64_t offset;
+		char* destination;
+		size_t size, position;
+		bool isPending;
+		std::string error;
+	};
+	
+	void queueRead(size_t slot)
+	{
+		Slot& s = _slots[slot];
+		// There is at most one read per slot, so the queue can not be full
+		io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+		io_uring_prep_read(sqe, _fd, s.destination + s.position, s.size - s.position, s.offset + s.position);
+		io_uring_sqe_set_data(sqe, &s);
+		s.isPending = true;
+	}
+	
+	void reapCompletion()
+	{
+		io_uring_cqe* cqe;
+		int result = io_uring_wait_cqe(&_ring, &cqe);
+		if(result < 0)
+			throw std::runtime_error(std::string("Error waiting for io_uring: ") + std::strerror(-result));
+		Slot& s = *static_cast<Slot*>(io_uring_cqe_get_data(cqe));
+		const int readSize = cqe->res;
+		io_uring_cqe_seen(&_ring, cqe);
+		s.isPending = false;
+		if(readSize < 0)
+			s.error = std::string("Error reading file: ") + std::strerror(-readSize);
+		else if(readSize == 0)
+			s.error = "Error reading file: unexpected end of file";
+		else {
+			s.position += readSize;
+			// Reads can be short, in which case the rest is requested
+			if(s.position != s.size)
+			{
+				queueRead(&s - _slots.data());
+				io_uring_submit(&_ring);
+			}
+		}
+	}
+	
+	int _fd;
+	io_uring _ring;
+	std::vector<Slot> _slots;
+};
+#endif
+
+} // anonymous namespace
+
+std::unique_ptr<AsyncReader> AsyncReader::Make(const std::string& filename, size_t queueDepth)
+{
+#ifdef HAVE_LIBURING
+	try {
+		return std::unique_ptr<AsyncReader>(new UringReader(filename, queueDepth));
+	} catch(std::exception&) {
+		// E.g. the kernel does not support io_uring: use threads instead
+	}
+#endif
+	return std::unique_ptr<AsyncReader>(new ThreadPoolReader(filename, queueDepth));
+}
@@ -0,0 +1,39 @@
+#ifndef ASYNC_READER_H
+#define ASYNC_READER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * Reads byte ranges of a file asynchronously, so that many reads can be in
+ * flight at once. Fast storage (e.g. NVMe arrays) only reaches its bandwidth
+ * with a high queue depth.
+ *
+ * Reads are identified by a slot number below the queue depth. A slot can be
+ * reused after Wait() has returned for it.
+ */
+class AsyncReader
+{
+public:
+	virtual ~AsyncReader() { }
+	
+	/**
+	 * Create a reader for the given file. It uses io_uring when aartfaac2ms is
+	 * built with liburing and the kernel supports it, and otherwise a pool of
+	 * threads that each do blocking reads.
+	 */
+	static std::unique_ptr<AsyncReader> Make(const std::string& filename, size_t queueDepth);
+	
+	/**
+	 * Start reading size bytes at the given offset into destination.
+	 */
+	virtual void Submit(size_t slot, uint64_t offset, char* destination, size_t size) = 0;
+	
+	/**
+	 * Wait until the read of the slot has finished. Throws if it failed.
+	 */
+	virtual void Wait(size_t slot) = 0;
+};
+
+#endif
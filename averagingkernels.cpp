@@ -0,0 +1,116 @@
+#include "averagingkernels.h"
+
+#include <cstring>
+
+#include <immintrin.h>
+#include <xmmintrin.h>
+
+void AccumulateScalar(size_t nChannels, size_t nPol, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, uint32_t* rowCounts)
+{
+	size_t srcIndex = 0;
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		for(size_t p=0; p!=nPol; ++p)
+		{
+			const size_t destIndex = (ch / freqAvgFactor) * nPol + p;
+			allData[destIndex] += data[srcIndex];
+			if(!flags[srcIndex])
+			{
+				rowData[destIndex] += data[srcIndex] * weights[srcIndex];
+				rowWeights[destIndex] += weights[srcIndex];
+				rowCounts[destIndex]++;
+			}
+			++srcIndex;
+		}
+	}
+}
+
+/**
+ * Accumulates one row with SSE2 instructions. The four polarizations of a
+ * channel take two registers for the data and one for the weights. Flags are
+ * turned into masks, like in AccumulateAVX2().
+ */
+void AccumulateSSE(size_t nChannels, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, uint32_t* rowCounts)
+{
+	const __m128i zero = _mm_setzero_si128();
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		const size_t srcIndex = ch * 4;
+		const size_t destIndex = (ch / freqAvgFactor) * 4;
+		
+		// All bits set for an unflagged polarization
+		const __m128i unflagged = _mm_cmpeq_epi32(_mm_setr_epi32(flags[srcIndex], flags[srcIndex+1], flags[srcIndex+2], flags[srcIndex+3]), zero);
+		const __m128 unflaggedPs = _mm_castsi128_ps(unflagged);
+		// Masks for the real and imaginary values of polarizations 0-1 and 2-3
+		const __m128
+			unflaggedA = _mm_unpacklo_ps(unflaggedPs, unflaggedPs),
+			unflaggedB = _mm_unpackhi_ps(unflaggedPs, unflaggedPs);
+		
+		const __m128 dataValA = _mm_load_ps(reinterpret_cast<const float*>(&data[srcIndex]));
+		const __m128 dataValB = _mm_load_ps(reinterpret_cast<const float*>(&data[srcIndex+2]));
+		float* allDataPtr = reinterpret_cast<float*>(&allData[destIndex]);
+		_mm_store_ps(allDataPtr, _mm_add_ps(_mm_load_ps(allDataPtr), dataValA));
+		_mm_store_ps(allDataPtr+4, _mm_add_ps(_mm_load_ps(allDataPtr+4), dataValB));
+		
+		const __m128 weight4 = _mm_and_ps(_mm_load_ps(&weights[srcIndex]), unflaggedPs);
+		const __m128
+			weightsA = _mm_unpacklo_ps(weight4, weight4),
+			weightsB = _mm_unpackhi_ps(weight4, weight4);
+		// The data is masked too, so that non-finite flagged values are left out
+		float* rowDataPtr = reinterpret_cast<float*>(&rowData[destIndex]);
+		_mm_store_ps(rowDataPtr, _mm_add_ps(_mm_load_ps(rowDataPtr), _mm_mul_ps(_mm_and_ps(dataValA, unflaggedA), weightsA)));
+		_mm_store_ps(rowDataPtr+4, _mm_add_ps(_mm_load_ps(rowDataPtr+4), _mm_mul_ps(_mm_and_ps(dataValB, unflaggedB), weightsB)));
+		
+		_mm_store_ps(&rowWeights[destIndex], _mm_add_ps(_mm_load_ps(&rowWeights[destIndex]), weight4));
+		
+		// The mask is -1 for unflagged values, so subtracting it counts them
+		__m128i* countPtr = reinterpret_cast<__m128i*>(&rowCounts[destIndex]);
+		_mm_store_si128(countPtr, _mm_sub_epi32(_mm_load_si128(countPtr), unflagged));
+	}
+}
+
+/**
+ * Accumulates one row with AVX2 and FMA instructions. Each channel's four
+ * polarizations fill one 256-bit register. Flags are turned into masks,
+ * so flagged samples are excluded without branching.
+ */
+__attribute__((target("avx2,fma")))
+void AccumulateAVX2(size_t nChannels, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, uint32_t* rowCounts)
+{
+	// Repeats each of the 4 polarizations for the real and imaginary value
+	const __m256i duplicatePairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	const __m128i zero = _mm_setzero_si128();
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		const size_t srcIndex = ch * 4;
+		const size_t destIndex = (ch / freqAvgFactor) * 4;
+		
+		uint32_t flagBytes;
+		std::memcpy(&flagBytes, &flags[srcIndex], sizeof(flagBytes));
+		// All bits set for an unflagged polarization
+		const __m128i unflagged = _mm_cmpeq_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(flagBytes)), zero);
+		const __m256 unflagged8 = _mm256_castsi256_ps(_mm256_permutevar8x32_epi32(_mm256_castsi128_si256(unflagged), duplicatePairs));
+		
+		const __m256 dataVal = _mm256_loadu_ps(reinterpret_cast<const float*>(&data[srcIndex]));
+		float* allDataPtr = reinterpret_cast<float*>(&allData[destIndex]);
+		_mm256_store_ps(allDataPtr, _mm256_add_ps(_mm256_load_ps(allDataPtr), dataVal));
+		
+		const __m128 weight4 = _mm_and_ps(_mm_loadu_ps(&weights[srcIndex]), _mm_castsi128_ps(unflagged));
+		const __m256 weight8 = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(weight4), duplicatePairs);
+		// The data is masked too, so that non-finite flagged values are left out
+		float* rowDataPtr = reinterpret_cast<float*>(&rowData[destIndex]);
+		_mm256_store_ps(rowDataPtr, _mm256_fmadd_ps(_mm256_and_ps(dataVal, unflagged8), weight8, _mm256_load_ps(rowDataPtr)));
+		
+		_mm_store_ps(&rowWeights[destIndex], _mm_add_ps(_mm_load_ps(&rowWeights[destIndex]), weight4));
+		
+		// The mask is -1 for unflagged values, so subtracting it counts them
+		__m128i* countPtr = reinterpret_cast<__m128i*>(&rowCounts[destIndex]);
+		_mm_store_si128(countPtr, _mm_sub_epi32(_mm_load_si128(countPtr), unflagged));
+	}
+}
+
+bool HasAVX2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
@@ -0,0 +1,32 @@
+#ifndef AVERAGING_KERNELS_H
+#define AVERAGING_KERNELS_H
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Kernels that accumulate one row into the averaging buffers of a baseline.
+ * The row has nChannels channels of nPol values, of which every
+ * freqAvgFactor consecutive channels are added to the same output channel.
+ * All kernels have the same flag semantics: allData receives every value,
+ * while rowData (weighted), rowWeights and rowCounts only receive the values
+ * that are not flagged. Flags are applied per polarization.
+ *
+ * The SSE and AVX2 kernels require four polarizations, and that the output
+ * buffers are aligned to 16 (SSE) or 32 (AVX2) bytes. The results of the
+ * AVX2 kernel can differ in the last bit, because it uses fused
+ * multiply-adds.
+ */
+void AccumulateScalar(size_t nChannels, size_t nPol, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, uint32_t* rowCounts);
+
+void AccumulateSSE(size_t nChannels, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, uint32_t* rowCounts);
+
+void AccumulateAVX2(size_t nChannels, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, uint32_t* rowCounts);
+
+/**
+ * True when the CPU supports the instructions of AccumulateAVX2().
+ */
+bool HasAVX2();
+
+#endif
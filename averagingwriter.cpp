@@ -1,68 +1,177 @@
 #include "averagingwriter.h"
+#include "averagingkernels.h"
 
-#include <xmmintrin.h>
+#include <algorithm>
+#include <cmath>
 
 #define USE_SSE
 
+#define SPEED_OF_LIGHT 299792458.0        // speed of light in m/s
+#define EARTH_ROTATION_RATE 7.2921150e-5  // in rad/s
+
+namespace {
+	const bool useAVX2 = HasAVX2();
+}
+
+size_t AveragingWriter::baselineTimeAvgFactor(size_t antenna1, size_t antenna2) const
+{
+	if(_maxDecorrelation == 0.0)
+		return _timeAvgFactor;
+	
+	const Writer::AntennaInfo &a1 = _antennae[antenna1], &a2 = _antennae[antenna2];
+	const double
+		dx = a1.x - a2.x, dy = a1.y - a2.y, dz = a1.z - a2.z,
+		length = std::sqrt(dx*dx + dy*dy + dz*dz);
+	// The fastest fringe, of a source on the horizon, has a rate of
+	// omega_E * L / lambda (in cycles/s). Averaging it over a time T reduces
+	// its amplitude by sinc(pi * rate * T) ~ 1 - (pi * rate * T)^2 / 6.
+	const double fringeRate = EARTH_ROTATION_RATE * length * _maxFrequency / SPEED_OF_LIGHT;
+	if(fringeRate == 0.0)
+		return _timeAvgFactor;
+	const double maxTime = std::sqrt(6.0 * _maxDecorrelation) / (M_PI * fringeRate);
+	const size_t factor = size_t(maxTime / _integrationTime);
+	return std::max<size_t>(1, std::min(factor, _timeAvgFactor));
+}
+
 void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
-	Buffer &buffer = getBuffer(antenna1, antenna2);
-	size_t srcIndex = 0;
-	for(size_t ch=0; ch!=_avgChannelCount*_freqAvgFactor; ++ch)
+	if(_stagedRows.size() == _batchCapacity)
+		processBatch();
+	
+	const size_t nValues = _originalChannelCount*_polarizationCount;
+	const size_t offset = _stagedRows.size() * nValues;
+	std::copy_n(data, nValues, &_stagedData[offset]);
+	std::copy_n(flags, nValues, &_stagedFlags[offset]);
+	std::copy_n(weights, nValues, &_stagedWeights[offset]);
+	StagedRow row;
+	row.antenna1 = antenna1;
+	row.antenna2 = antenna2;
+	row.time = time;
+	row.u = u;
+	row.v = v;
+	row.w = w;
+	row.interval = interval;
+	row.completed = false;
+	_stagedRows.emplace_back(row);
+}
+
+void AveragingWriter::processBatch()
+{
+	const size_t nRows = _stagedRows.size();
+	if(nRows == 0)
+		return;
+	
+	// Every baseline occurs at most once in a batch, so the rows can be
+	// accumulated independently. Each thread gets a consecutive range of
+	// rows, which are normally consecutive baselines.
+	const size_t nInputValues = _originalChannelCount*_polarizationCount, nOutputValues = _avgChannelCount*_polarizationCount;
+	if(!_parallelFor)
+		_parallelFor.reset(new aocommon::ParallelFor<size_t>(_threadCount));
+	const size_t nPartitions = std::min(_threadCount, nRows);
+	_parallelFor->Run(0, nPartitions, [&](size_t partition, size_t)
 	{
-#ifndef USE_SSE
-		for(size_t p=0; p!=4; ++p)
+		const size_t
+			start = nRows * partition / nPartitions,
+			end = nRows * (partition+1) / nPartitions;
+		for(size_t i=start; i!=end; ++i)
 		{
-			const size_t destIndex = (ch / _freqAvgFactor) * 4 + p;
-			buffer._flaggedAndUnflaggedData[destIndex] += data[srcIndex];
-			if(!flags[srcIndex])
+			StagedRow& row = _stagedRows[i];
+			const size_t index = baselineIndex(row.antenna1, row.antenna2);
+			accumulate(index, row, &_stagedData[i*nInputValues], &_stagedFlags[i*nInputValues], &_stagedWeights[i*nInputValues]);
+			// AddRows() has already advanced the timestep index past the
+			// timestep of these rows
+			row.completed = _timestepIndex % _buffers[index]._timeAvgFactor == 0;
+			if(row.completed)
+				finishAverage(index, row, &_averagedData[i*nOutputValues], &_averagedFlags[i*nOutputValues], &_averagedWeights[i*nOutputValues]);
+		}
+	});
+	
+	// Write in the order in which the rows were received
+	for(size_t i=0; i!=nRows; ++i)
+	{
+		const StagedRow& row = _stagedRows[i];
+		if(row.completed)
+			_writer->WriteRow(row.time, row.time, row.antenna1, row.antenna2, row.u, row.v, row.w, row.interval, &_averagedData[i*nOutputValues], &_averagedFlags[i*nOutputValues], &_averagedWeights[i*nOutputValues]);
+	}
+	_stagedRows.clear();
+}
+
+void AveragingWriter::flushPartialIntervals()
+{
+	size_t count = 0;
+	for(const Buffer& buffer : _buffers)
+	{
+		if(buffer._rowTimestepCount != 0)
+			++count;
+	}
+	if(count == 0)
+		return;
+	
+	_writer->AddRows(count);
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+		{
+			const size_t index = baselineIndex(antenna1, antenna2);
+			if(_buffers[index]._rowTimestepCount != 0)
 			{
-				buffer._rowData[destIndex] += data[srcIndex] * weights[srcIndex];
-				buffer._rowWeights[destIndex] += weights[srcIndex];
-				buffer._rowCounts[destIndex]++;
+				StagedRow row;
+				row.antenna1 = antenna1;
+				row.antenna2 = antenna2;
+				finishAverage(index, row, _averagedData.get(), _averagedFlags.data(), _averagedWeights.get());
+				_writer->WriteRow(row.time, row.time, row.antenna1, row.antenna2, row.u, row.v, row.w, row.interval, _averagedData.get(), _averagedFlags.data(), _averagedWeights.get());
 			}
-			++srcIndex;
 		}
-#else
-		const size_t destIndex = (ch / _freqAvgFactor) * 4;
-		const __m128 dataValA = _mm_load_ps((float*) &data[srcIndex]);
-		const __m128 dataValB = _mm_load_ps((float*) &data[srcIndex+2]);
-		std::complex<float> *allDataPtr = &buffer._flaggedAndUnflaggedData[destIndex];
-		
-		// Perform *allDataPtr += dataVal
-		_mm_store_ps((float*) allDataPtr, _mm_add_ps(_mm_load_ps((float*) allDataPtr), dataValA));
-		_mm_store_ps((float*) (allDataPtr+2), _mm_add_ps(_mm_load_ps((float*) (allDataPtr+2)), dataValB));
-		
-		// Note that if one polarization is flagged, all are flagged
-		if(!flags[srcIndex])
+	}
+}
+
+void AveragingWriter::accumulate(size_t index, const StagedRow& row, const std::complex<float>* data, const bool* flags, const float* weights)
+{
+	Buffer &buffer = _buffers[index];
+	const ChannelBuffers channels = channelBuffers(index);
+	const size_t nPol = _polarizationCount;
+	if(useAVX2 && nPol == 4)
+		AccumulateAVX2(_avgChannelCount*_freqAvgFactor, _freqAvgFactor, data, flags, weights, channels._rowData, channels._flaggedAndUnflaggedData, channels._rowWeights, channels._rowCounts);
+#ifdef USE_SSE
+	else if(nPol == 4)
+		AccumulateSSE(_avgChannelCount*_freqAvgFactor, _freqAvgFactor, data, flags, weights, channels._rowData, channels._flaggedAndUnflaggedData, channels._rowWeights, channels._rowCounts);
+#endif
+	else
+		AccumulateScalar(_avgChannelCount*_freqAvgFactor, nPol, _freqAvgFactor, data, flags, weights, channels._rowData, channels._flaggedAndUnflaggedData, channels._rowWeights, channels._rowCounts);
+	buffer._rowTime += row.time;
+	buffer._rowU += row.u;
+	buffer._rowV += row.v;
+	buffer._rowW += row.w;
+	buffer._rowTimestepCount++;
+	buffer._interval += row.interval;
+}
+
+void AveragingWriter::finishAverage(size_t index, StagedRow& row, std::complex<float>* data, bool* flags, float* weights)
+{
+	Buffer& buffer = _buffers[index];
+	const ChannelBuffers channels = channelBuffers(index);
+	row.time = buffer._rowTime / buffer._rowTimestepCount;
+	row.u = buffer._rowU / buffer._rowTimestepCount;
+	row.v = buffer._rowV / buffer._rowTimestepCount;
+	row.w = buffer._rowW / buffer._rowTimestepCount;
+	row.interval = buffer._interval;
+	
+	for(size_t ch=0;ch!=_avgChannelCount*_polarizationCount;++ch)
+	{
+		if(channels._rowCounts[ch]==0)
 		{
-			const __m128 weightsA = _mm_set_ps(weights[srcIndex+1], weights[srcIndex+1], weights[srcIndex], weights[srcIndex]);
-			const __m128 weightsB = _mm_set_ps(weights[srcIndex+3], weights[srcIndex+3], weights[srcIndex+2], weights[srcIndex+2]);
-			std::complex<float> *destPtr = &buffer._rowData[destIndex];
-			
-			// Perform *destPtr += dataVal * weights
-			_mm_store_ps((float*) destPtr,     _mm_add_ps(_mm_load_ps((float*) destPtr), _mm_mul_ps(dataValA, weightsA)));
-			_mm_store_ps((float*) (destPtr+2), _mm_add_ps(_mm_load_ps((float*) (destPtr+2)), _mm_mul_ps(dataValB, weightsB)));
-			
-			// Perform buf.weight += weights
-			_mm_store_ps(&buffer._rowWeights[destIndex], _mm_add_ps(_mm_load_ps(&weights[srcIndex]), _mm_load_ps(&buffer._rowWeights[destIndex])));
-			
-			buffer._rowCounts[destIndex]++;
-			buffer._rowCounts[destIndex+1]++;
-			buffer._rowCounts[destIndex+2]++;
-			buffer._rowCounts[destIndex+3]++;
+			data[ch] = std::complex<float>(
+				channels._flaggedAndUnflaggedData[ch].real() / (buffer._rowTimestepCount*_freqAvgFactor),
+				channels._flaggedAndUnflaggedData[ch].imag() / (buffer._rowTimestepCount*_freqAvgFactor));
+			flags[ch] = true;
+		} else {
+			data[ch] = std::complex<float>(
+				channels._rowData[ch].real()/channels._rowWeights[ch],
+				channels._rowData[ch].imag()/channels._rowWeights[ch]);
+			flags[ch] = false;
 		}
-		
-		srcIndex += 4;
-#endif
+		weights[ch] = channels._rowWeights[ch];
 	}
-	buffer._rowTime += time;
-	buffer._rowU += u;
-	buffer._rowV += v;
-	buffer._rowW += w;
-	buffer._rowTimestepCount++;
-	buffer._interval += interval;
 	
-	if(buffer._rowTimestepCount == _timeAvgFactor)
-		writeCurrentTimestep(antenna1, antenna2);
+	resetBuffer(index);
 }
@@ -1,10 +1,21 @@
 #ifndef AVERAGING_MS_WRITER_H
 #define AVERAGING_MS_WRITER_H
 
+#include "aligned_ptr.h"
 #include "writer.h"
 
+#include <aocommon/parallelfor.h>
+#include <aocommon/uvector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <iostream>
 #include <memory>
+#include <vector>
 
 class UVWCalculater
 {
@@ -16,14 +27,66 @@ class AveragingWriter : public Writer
 {
 	public:
 		AveragingWriter(std::unique_ptr<Writer>&& writer, size_t timeCount, size_t freqAvgFactor)
-		: _writer(std::move(writer)), _timeAvgFactor(timeCount), _freqAvgFactor(freqAvgFactor), _rowsAdded(0),
-		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0)
+		: _writer(std::move(writer)), _timeAvgFactor(timeCount), _freqAvgFactor(freqAvgFactor), _timestepIndex(0),
+		_polarizationCount(4), _originalChannelCount(0), _avgChannelCount(0), _antennaCount(0),
+		_maxDecorrelation(0.0), _integrationTime(0.0), _maxFrequency(0.0),
+		_hasBaselineSelection(false),
+		_arena(empty_aligned<char>()),
+		_allDataOffset(0), _weightsOffset(0), _countsOffset(0), _blockSize(0),
+		_stagedData(empty_aligned<std::complex<float>>()),
+		_stagedWeights(empty_aligned<float>()),
+		_averagedData(empty_aligned<std::complex<float>>()),
+		_averagedWeights(empty_aligned<float>()),
+		_batchCapacity(0),
+		_threadCount(1),
+		_isFinished(false)
+		{
+		}
+		
+		/**
+		 * Set the number of threads that accumulate rows. Rows are collected in
+		 * batches, and the rows of a batch are divided over the threads. Should
+		 * be called before writing rows.
+		 */
+		void SetThreadCount(size_t nThreads)
+		{
+			_threadCount = nThreads;
+		}
+		
+		/**
+		 * Choose the time averaging factor per baseline, such that the
+		 * decorrelation of a source on the horizon stays below the given
+		 * fraction. The time averaging factor given to the constructor is
+		 * then used as the maximum factor. Should be called before writing
+		 * the metadata.
+		 */
+		void SetBaselineDependentAveraging(double maxDecorrelation, double integrationTime)
+		{
+			_maxDecorrelation = maxDecorrelation;
+			_integrationTime = integrationTime;
+		}
+		
+		/**
+		 * Align the averaging intervals to a grid of whole intervals since the
+		 * time zero point, instead of to the first timestep. This makes the
+		 * output independent of where the input starts, e.g. when converting
+		 * a selected interval. Should be called before ReserveRows().
+		 */
+		void SetTimeGrid(double startTime, double integrationTime)
 		{
+			_timestepIndex = size_t(std::round(startTime / integrationTime));
 		}
 		
 		virtual ~AveragingWriter() final override
 		{
-			destroyBuffers();
+			if(!_isFinished)
+			{
+				try {
+					Finish();
+				} catch(std::exception& e) {
+					std::cerr << "Error while writing the last averaged rows: " << e.what() << '\n';
+				}
+			}
 		}
 		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override
@@ -35,6 +98,9 @@ class AveragingWriter : public Writer
 			
 			_avgChannelCount = channels.size() / _freqAvgFactor;
 			_originalChannelCount = channels.size();
+			_maxFrequency = 0.0;
+			for(const Writer::ChannelInfo& channel : channels)
+				_maxFrequency = std::max(_maxFrequency, channel.chanFreq);
 			
 			std::vector<Writer::ChannelInfo> avgChannels(_avgChannelCount);
 			for(size_t ch=0; ch!=_avgChannelCount; ++ch)
@@ -68,14 +134,16 @@ class AveragingWriter : public Writer
 		{
 			_writer->WriteAntennae(antennae, time);
 			
+			_antennae = antennae;
 			_antennaCount = antennae.size();
 			if(_originalChannelCount != 0)
 				initBuffers();
 		}
 		
-		virtual void WritePolarizationForLinearPols(bool flagRow) final override
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) final override
 		{
-			_writer->WritePolarizationForLinearPols(flagRow);
+			_writer->WritePolarizations(mode, flagRow);
+			_polarizationCount = PolarizationCount(mode);
 		}
 		
 		virtual void WriteSource(const Writer::SourceInfo &source) final override
@@ -98,13 +166,66 @@ class AveragingWriter : public Writer
 			_writer->SetArrayLocation(x, y, z);
 		}
 		
+		virtual void SetBaselineSelection(const std::vector<std::pair<size_t, size_t>>& baselines) final override
+		{
+			_writer->SetBaselineSelection(baselines);
+			
+			_baselineSelection = baselines;
+			_hasBaselineSelection = true;
+			if(!_buffers.empty())
+				selectBuffers();
+		}
+		
+		virtual void ReserveRows(size_t rowCount) final override
+		{
+			// Every interval that overlaps with the timesteps is written,
+			// including partial intervals at the start and end.
+			const size_t nBaselines = _selectedBuffers.size();
+			if(nBaselines != 0 && rowCount != 0)
+			{
+				const size_t
+					first = _timestepIndex,
+					last = _timestepIndex + rowCount / nBaselines - 1;
+				// The number of rows is given per baseline, because the averaging
+				// factor can differ per baseline
+				std::vector<bool> isSelected(_buffers.size(), false);
+				for(size_t index : _selectedBuffers)
+					isSelected[index] = true;
+				std::vector<BaselineRowCount> rowCounts;
+				rowCounts.reserve(nBaselines);
+				for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+				{
+					for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+					{
+						const size_t index = baselineIndex(antenna1, antenna2);
+						if(isSelected[index])
+						{
+							const size_t factor = _buffers[index]._timeAvgFactor;
+							rowCounts.push_back(BaselineRowCount{antenna1, antenna2, last / factor - first / factor + 1});
+						}
+					}
+				}
+				_writer->ReserveBaselineRows(rowCounts);
+			}
+		}
+		
 		virtual void AddRows(size_t rowCount) final override
 		{
-			if(_rowsAdded == 0)
-				_writer->AddRows(rowCount);
-			_rowsAdded++;
-			if(_rowsAdded == _timeAvgFactor)
-				_rowsAdded=0;
+			// The rows of the previous timestep are written before announcing
+			// the next ones
+			processBatch();
+			
+			// Rows are written for the baselines whose averaging interval ends
+			// at this timestep.
+			size_t count = 0;
+			for(size_t index : _selectedBuffers)
+			{
+				if((_timestepIndex+1) % _buffers[index]._timeAvgFactor == 0)
+					++count;
+			}
+			if(count != 0)
+				_writer->AddRows(count);
+			++_timestepIndex;
 		}
 		
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
@@ -114,9 +235,17 @@ class AveragingWriter : public Writer
 			_writer->WriteHistoryItem(commandLine, application, params);
 		}
 		
+		virtual void Finish() final override
+		{
+			_isFinished = true;
+			processBatch();
+			flushPartialIntervals();
+			_writer->Finish();
+		}
+		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override {
-			const Buffer &buffer = getBuffer(antenna1, antenna2);
-			return buffer._rowTimestepCount==0;
+			processBatch();
+			return _buffers[baselineIndex(antenna1, antenna2)]._rowTimestepCount==0;
 		}
 		
 		virtual bool AreAntennaPositionsLocal() const final override
@@ -128,128 +257,169 @@ class AveragingWriter : public Writer
 			return _writer->CanWriteStatistics();
 		}
 	private:
+		/**
+		 * Averaging state of one baseline. The per-channel accumulators of all
+		 * baselines are kept in one arena, see channelBuffers().
+		 */
 		struct Buffer
 		{
-			Buffer(size_t avgChannelCount)
-			{
-				_rowData = new std::complex<float>[avgChannelCount*4];
-				_flaggedAndUnflaggedData = new std::complex<float>[avgChannelCount*4];
-				_rowFlags = new bool[avgChannelCount*4];
-				_rowWeights = new float[avgChannelCount*4];
-				_rowCounts = new size_t[avgChannelCount*4];
-				initZero(avgChannelCount);
-			}
-			
-			~Buffer()
-			{
-				delete[] _rowData;
-				delete[] _flaggedAndUnflaggedData;
-				delete[] _rowFlags;
-				delete[] _rowWeights;
-				delete[] _rowCounts;
-			}
-			
-			void initZero(size_t avgChannelCount)
-			{
-				_rowTime = 0.0;
-				_rowU = 0.0;
-				_rowV = 0.0;
-				_rowW = 0.0;
-				_rowTimestepCount = 0;
-				_interval = 0.0;
-				for(size_t ch=0; ch!=avgChannelCount*4; ++ch)
-				{
-					_rowData[ch] = 0.0;
-					_flaggedAndUnflaggedData[ch] = 0.0;
-					_rowFlags[ch] = false;
-					_rowWeights[ch] = 0.0;
-					_rowCounts[ch] = 0;
-				}
-			}
-			
+			size_t _timeAvgFactor;
 			double _rowTime, _rowU, _rowV, _rowW;
 			size_t _rowTimestepCount;
 			double _interval;
+		};
+		
+		/**
+		 * Pointers to the accumulators of one baseline. These are consecutive
+		 * arrays of _avgChannelCount*_polarizationCount values within the block of the baseline
+		 * in the arena, each starting at a cache line boundary.
+		 */
+		struct ChannelBuffers
+		{
 			std::complex<float> *_rowData, *_flaggedAndUnflaggedData;
-			bool *_rowFlags;
 			float *_rowWeights;
-			size_t *_rowCounts;
+			uint32_t *_rowCounts;
 		};
 		
-		void writeCurrentTimestep(size_t antenna1, size_t antenna2)
+		/**
+		 * A row as received by WriteRow(). Its data, flags and weights are
+		 * stored in the staging buffers at the position of the row in the batch.
+		 * After processing, the row holds the averaged metadata if it completed
+		 * an averaging interval, in which case the averaged values are in the
+		 * averaging buffers.
+		 */
+		struct StagedRow
 		{
-			Buffer& buffer = getBuffer(antenna1, antenna2);
-			double
-				time = buffer._rowTime / buffer._rowTimestepCount,
-				u = buffer._rowU / buffer._rowTimestepCount,
-				v = buffer._rowV / buffer._rowTimestepCount,
-				w = buffer._rowW / buffer._rowTimestepCount;
-			
-			for(size_t ch=0;ch!=_avgChannelCount*4;++ch)
-			{
-				if(buffer._rowCounts[ch]==0)
-				{
-					buffer._rowData[ch] = std::complex<float>(
-						buffer._flaggedAndUnflaggedData[ch].real() / (buffer._rowTimestepCount*_freqAvgFactor),
-						buffer._flaggedAndUnflaggedData[ch].imag() / (buffer._rowTimestepCount*_freqAvgFactor));
-					buffer._rowFlags[ch] = true;
-				} else {
-					buffer._rowData[ch] = std::complex<float>(
-						buffer._rowData[ch].real()/buffer._rowWeights[ch],
-						buffer._rowData[ch].imag()/buffer._rowWeights[ch]);
-					buffer._rowFlags[ch] = false;
-				}
-			}
-			
-			_writer->WriteRow(time, time, antenna1, antenna2, u, v, w, buffer._interval, buffer._rowData, buffer._rowFlags, buffer._rowWeights);
-			
-			buffer.initZero(_avgChannelCount);
+			size_t antenna1, antenna2;
+			double time, u, v, w, interval;
+			bool completed;
+		};
+		
+		void processBatch();
+		void flushPartialIntervals();
+		void accumulate(size_t index, const StagedRow& row, const std::complex<float>* data, const bool* flags, const float* weights);
+		void finishAverage(size_t index, StagedRow& row, std::complex<float>* data, bool* flags, float* weights);
+		
+		size_t baselineIndex(size_t antenna1, size_t antenna2) const
+		{
+			// Index in the upper triangle, including auto-correlations
+			return antenna1*_antennaCount - antenna1*(antenna1-1)/2 + antenna2 - antenna1;
+		}
+		
+		ChannelBuffers channelBuffers(size_t index)
+		{
+			char* block = _arena.get() + index * _blockSize;
+			ChannelBuffers channels;
+			channels._rowData = reinterpret_cast<std::complex<float>*>(block);
+			channels._flaggedAndUnflaggedData = reinterpret_cast<std::complex<float>*>(block + _allDataOffset);
+			channels._rowWeights = reinterpret_cast<float*>(block + _weightsOffset);
+			channels._rowCounts = reinterpret_cast<uint32_t*>(block + _countsOffset);
+			return channels;
 		}
 		
-		Buffer &getBuffer(size_t antenna1, size_t antenna2)
+		void resetBuffer(size_t index)
 		{
-			return *_buffers[antenna1*_antennaCount + antenna2];
+			Buffer& buffer = _buffers[index];
+			buffer._rowTime = 0.0;
+			buffer._rowU = 0.0;
+			buffer._rowV = 0.0;
+			buffer._rowW = 0.0;
+			buffer._rowTimestepCount = 0;
+			buffer._interval = 0.0;
+			std::memset(_arena.get() + index * _blockSize, 0, _blockSize);
 		}
 		
-		void setBuffer(size_t antenna1, size_t antenna2, Buffer *buffer)
+		static size_t toCacheLines(size_t size)
 		{
-			_buffers[antenna1*_antennaCount + antenna2] = buffer;
+			return (size + 63) / 64 * 64;
 		}
 		
 		void initBuffers()
 		{
-			destroyBuffers();
-			_buffers.resize(_antennaCount*_antennaCount);
+			const size_t nValues = _avgChannelCount*_polarizationCount;
+			_allDataOffset = toCacheLines(nValues * sizeof(std::complex<float>));
+			_weightsOffset = _allDataOffset + toCacheLines(nValues * sizeof(std::complex<float>));
+			_countsOffset = _weightsOffset + toCacheLines(nValues * sizeof(float));
+			_blockSize = _countsOffset + toCacheLines(nValues * sizeof(uint32_t));
+			
+			const size_t nBaselines = _antennaCount * (_antennaCount + 1) / 2;
+			_buffers.resize(nBaselines);
+			selectBuffers();
+			_arena = make_aligned<char>(nBaselines * _blockSize, 64);
 			for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
 			{
-				for(size_t antenna2=0; antenna2!=antenna1; ++antenna2)
-					setBuffer(antenna1, antenna2, 0);
-				
 				for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
 				{
-					Buffer *buffer = new Buffer(_avgChannelCount);
-					setBuffer(antenna1, antenna2, buffer);
+					const size_t index = baselineIndex(antenna1, antenna2);
+					_buffers[index]._timeAvgFactor = baselineTimeAvgFactor(antenna1, antenna2);
+					resetBuffer(index);
 				}
 			}
+			
+			// Collect up to a timestep of rows per batch, limited to about 64 MB
+			const size_t nInputValues = _originalChannelCount*_polarizationCount;
+			const size_t rowSize = nInputValues * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float)) +
+				nValues * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float));
+			_batchCapacity = std::max<size_t>(1, std::min(nBaselines, (size_t(64) << 20) / rowSize));
+			_stagedRows.reserve(_batchCapacity);
+			_stagedData = make_aligned<std::complex<float>>(_batchCapacity * nInputValues, 16);
+			_stagedFlags.resize(_batchCapacity * nInputValues);
+			_stagedWeights = make_aligned<float>(_batchCapacity * nInputValues, 16);
+			_averagedData = make_aligned<std::complex<float>>(_batchCapacity * nValues, 16);
+			_averagedFlags.resize(_batchCapacity * nValues);
+			_averagedWeights = make_aligned<float>(_batchCapacity * nValues, 16);
 		}
 		
-		void destroyBuffers()
+		/**
+		 * Sets the buffers for which rows are written from the baseline
+		 * selection, or to all buffers without selection. The selection can
+		 * be set before or after the metadata, so this is done both when the
+		 * selection is set and when the buffers are initialized.
+		 */
+		void selectBuffers()
 		{
-			if(!_buffers.empty())
+			_selectedBuffers.clear();
+			if(_hasBaselineSelection)
 			{
-				for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
-				{
-					for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
-						delete &getBuffer(antenna1, antenna2);
-				}
+				for(const std::pair<size_t, size_t>& baseline : _baselineSelection)
+					_selectedBuffers.emplace_back(baselineIndex(baseline.first, baseline.second));
+			}
+			else {
+				for(size_t index=0; index!=_buffers.size(); ++index)
+					_selectedBuffers.emplace_back(index);
 			}
-			_buffers.clear();
 		}
 		
+		size_t baselineTimeAvgFactor(size_t antenna1, size_t antenna2) const;
+		
 		std::unique_ptr<Writer> _writer;
-		size_t _timeAvgFactor, _freqAvgFactor, _rowsAdded;
-		size_t _originalChannelCount, _avgChannelCount, _antennaCount;
-		std::vector<Buffer*> _buffers;
+		size_t _timeAvgFactor, _freqAvgFactor, _timestepIndex;
+		size_t _polarizationCount, _originalChannelCount, _avgChannelCount, _antennaCount;
+		double _maxDecorrelation, _integrationTime, _maxFrequency;
+		std::vector<Writer::AntennaInfo> _antennae;
+		std::vector<Buffer> _buffers;
+		std::vector<std::pair<size_t, size_t>> _baselineSelection;
+		bool _hasBaselineSelection;
+		// Indices in _buffers of the baselines for which rows are written
+		std::vector<size_t> _selectedBuffers;
+		
+		// Accumulators of all baselines, a block of _blockSize bytes per baseline
+		aligned_ptr<char> _arena;
+		size_t _allDataOffset, _weightsOffset, _countsOffset, _blockSize;
+		
+		// Rows that have been received but not yet accumulated
+		std::vector<StagedRow> _stagedRows;
+		aligned_ptr<std::complex<float>> _stagedData;
+		aocommon::UVector<bool> _stagedFlags;
+		aligned_ptr<float> _stagedWeights;
+		aligned_ptr<std::complex<float>> _averagedData;
+		aocommon::UVector<bool> _averagedFlags;
+		aligned_ptr<float> _averagedWeights;
+		size_t _batchCapacity;
+		
+		size_t _threadCount;
+		std::unique_ptr<aocommon::ParallelFor<size_t>> _parallelFor;
+		bool _isFinished;
 };
 
 #endif
@@ -0,0 +1,242 @@
+#include "aligned_ptr.h"
+#include "averagingkernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <xmmintrin.h>
+
+/**
+ * Measures the throughput of the averaging kernels on random data, and checks
+ * that they give the same averages. Rows are accumulated round-robin into the
+ * buffers of a number of baselines, like the AveragingWriter does.
+ */
+namespace {
+
+struct Buffers
+{
+	Buffers(size_t nBaselines, size_t nValues) :
+		rowData(make_aligned<std::complex<float>>(nBaselines * nValues, 64)),
+		allData(make_aligned<std::complex<float>>(nBaselines * nValues, 64)),
+		rowWeights(make_aligned<float>(nBaselines * nValues, 64)),
+		rowCounts(make_aligned<uint32_t>(nBaselines * nValues, 64)),
+		legacyCounts(nBaselines * nValues),
+		size(nBaselines * nValues)
+	{
+		Reset();
+	}
+	
+	void Reset()
+	{
+		std::fill_n(rowData.get(), size, std::complex<float>(0.0, 0.0));
+		std::fill_n(allData.get(), size, std::complex<float>(0.0, 0.0));
+		std::fill_n(rowWeights.get(), size, 0.0f);
+		std::fill_n(rowCounts.get(), size, 0u);
+		std::fill(legacyCounts.begin(), legacyCounts.end(), 0);
+	}
+	
+	aligned_ptr<std::complex<float>> rowData, allData;
+	aligned_ptr<float> rowWeights;
+	aligned_ptr<uint32_t> rowCounts;
+	// The legacy kernel counts in size_t
+	std::vector<size_t> legacyCounts;
+	size_t size;
+};
+
+enum Kernel { LegacySSEKernel, ScalarKernel, SSEKernel, AVX2Kernel };
+
+const char* kernelName(Kernel kernel)
+{
+	switch(kernel)
+	{
+		case LegacySSEKernel: return "legacy SSE";
+		case SSEKernel: return "SSE";
+		case AVX2Kernel: return "AVX2";
+		case ScalarKernel:
+		default: return "scalar";
+	}
+}
+
+/**
+ * The SSE code that AccumulateSSE() replaced, as a baseline for the
+ * throughput. It branches on the flag of the first polarization of a
+ * channel, so its averages differ from the other kernels when the
+ * polarizations of a channel have different flags.
+ */
+void accumulateLegacySSE(size_t nChannels, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, std::complex<float>* rowData, std::complex<float>* allData, float* rowWeights, size_t* rowCounts)
+{
+	size_t srcIndex = 0;
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		const size_t destIndex = (ch / freqAvgFactor) * 4;
+		const __m128 dataValA = _mm_load_ps((float*) &data[srcIndex]);
+		const __m128 dataValB = _mm_load_ps((float*) &data[srcIndex+2]);
+		std::complex<float> *allDataPtr = &allData[destIndex];
+		_mm_store_ps((float*) allDataPtr, _mm_add_ps(_mm_load_ps((float*) allDataPtr), dataValA));
+		_mm_store_ps((float*) (allDataPtr+2), _mm_add_ps(_mm_load_ps((float*) (allDataPtr+2)), dataValB));
+		if(!flags[srcIndex])
+		{
+			const __m128 weightsA = _mm_set_ps(weights[srcIndex+1], weights[srcIndex+1], weights[srcIndex], weights[srcIndex]);
+			const __m128 weightsB = _mm_set_ps(weights[srcIndex+3], weights[srcIndex+3], weights[srcIndex+2], weights[srcIndex+2]);
+			std::complex<float> *destPtr = &rowData[destIndex];
+			_mm_store_ps((float*) destPtr, _mm_add_ps(_mm_load_ps((float*) destPtr), _mm_mul_ps(dataValA, weightsA)));
+			_mm_store_ps((float*) (destPtr+2), _mm_add_ps(_mm_load_ps((float*) (destPtr+2)), _mm_mul_ps(dataValB, weightsB)));
+			_mm_store_ps(&rowWeights[destIndex], _mm_add_ps(_mm_load_ps(&weights[srcIndex]), _mm_load_ps(&rowWeights[destIndex])));
+			rowCounts[destIndex]++;
+			rowCounts[destIndex+1]++;
+			rowCounts[destIndex+2]++;
+			rowCounts[destIndex+3]++;
+		}
+		srcIndex += 4;
+	}
+}
+
+/**
+ * Returns the number of seconds taken to accumulate nRows rows.
+ */
+double run(Kernel kernel, size_t nRows, size_t nBaselines, size_t nChannels, size_t freqAvgFactor, const std::complex<float>* data, const bool* flags, const float* weights, Buffers& buffers)
+{
+	const size_t nInputValues = nChannels * 4, nOutputValues = nChannels / freqAvgFactor * 4;
+	const auto start = std::chrono::steady_clock::now();
+	for(size_t row=0; row!=nRows; ++row)
+	{
+		const size_t baseline = row % nBaselines;
+		const size_t input = (row % 16) * nInputValues, output = baseline * nOutputValues;
+		std::complex<float>* rowData = &buffers.rowData[output];
+		std::complex<float>* allData = &buffers.allData[output];
+		float* rowWeights = &buffers.rowWeights[output];
+		uint32_t* rowCounts = &buffers.rowCounts[output];
+		switch(kernel)
+		{
+			case LegacySSEKernel:
+				accumulateLegacySSE(nChannels, freqAvgFactor, &data[input], &flags[input], &weights[input], rowData, allData, rowWeights, &buffers.legacyCounts[output]);
+				break;
+			case ScalarKernel:
+				AccumulateScalar(nChannels, 4, freqAvgFactor, &data[input], &flags[input], &weights[input], rowData, allData, rowWeights, rowCounts);
+				break;
+			case SSEKernel:
+				AccumulateSSE(nChannels, freqAvgFactor, &data[input], &flags[input], &weights[input], rowData, allData, rowWeights, rowCounts);
+				break;
+			case AVX2Kernel:
+				AccumulateAVX2(nChannels, freqAvgFactor, &data[input], &flags[input], &weights[input], rowData, allData, rowWeights, rowCounts);
+				break;
+		}
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double relativeDifference(std::complex<float> a, std::complex<float> b)
+{
+	return std::abs(a - b) / std::max(std::abs(a), 1e-30f);
+}
+
+/**
+ * Largest relative difference between the weighted and the unflagged
+ * averages of two runs. Counts and weights should be equal.
+ */
+double compare(const Buffers& a, const Buffers& b)
+{
+	double maxDifference = 0.0;
+	for(size_t i=0; i!=a.size; ++i)
+	{
+		if(a.rowCounts[i] != b.rowCounts[i] || a.rowWeights[i] != b.rowWeights[i])
+			return HUGE_VAL;
+		if(a.rowWeights[i] != 0.0)
+			maxDifference = std::max(maxDifference, relativeDifference(a.rowData[i], b.rowData[i]));
+		maxDifference = std::max(maxDifference, relativeDifference(a.allData[i], b.allData[i]));
+	}
+	return maxDifference;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	size_t nChannels = 64, freqAvgFactor = 1, nBaselines = 288*289/2, nRows = 2000000;
+	int argi = 1;
+	while(argi < argc && argv[argi][0] == '-')
+	{
+		const std::string p(&argv[argi][1]);
+		if(p == "channels")
+		{
+			++argi;
+			nChannels = std::atoi(argv[argi]);
+		}
+		else if(p == "freq-avg")
+		{
+			++argi;
+			freqAvgFactor = std::atoi(argv[argi]);
+		}
+		else if(p == "baselines")
+		{
+			++argi;
+			nBaselines = std::atoi(argv[argi]);
+		}
+		else if(p == "rows")
+		{
+			++argi;
+			nRows = std::atoi(argv[argi]);
+		}
+		else {
+			std::cerr <<
+				"Syntax: avgbenchmark [options]\n"
+				"options:\n"
+				"  -channels <count>\n"
+				"  -freq-avg <factor>\n"
+				"  -baselines <count>\n"
+				"  -rows <count>\n";
+			return 1;
+		}
+		++argi;
+	}
+	if(nChannels == 0 || freqAvgFactor == 0 || nChannels % freqAvgFactor != 0 || nBaselines == 0)
+	{
+		std::cerr << "The number of channels should be a non-zero multiple of the averaging factor.\n";
+		return 1;
+	}
+	
+	// 16 different input rows, with about 10% of the values flagged per polarization
+	const size_t nInputValues = nChannels * 4;
+	std::mt19937 rng;
+	std::normal_distribution<float> gaussian;
+	std::uniform_real_distribution<float> uniform(0.0, 1.0);
+	aligned_ptr<std::complex<float>> data = make_aligned<std::complex<float>>(16 * nInputValues, 32);
+	aligned_ptr<float> weights = make_aligned<float>(16 * nInputValues, 32);
+	std::vector<char> flagBuffer(16 * nInputValues);
+	bool* flags = reinterpret_cast<bool*>(flagBuffer.data());
+	for(size_t i=0; i!=16*nInputValues; ++i)
+	{
+		data[i] = std::complex<float>(gaussian(rng), gaussian(rng));
+		weights[i] = uniform(rng);
+		flags[i] = uniform(rng) < 0.1;
+	}
+	
+	std::vector<Kernel> kernels{LegacySSEKernel, ScalarKernel, SSEKernel};
+	if(HasAVX2())
+		kernels.emplace_back(AVX2Kernel);
+	else
+		std::cout << "This CPU does not support AVX2 and FMA; the AVX2 kernel is skipped.\n";
+	
+	const size_t nOutputValues = nChannels / freqAvgFactor * 4;
+	const double megaBytes = double(nRows) * nInputValues * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float)) * 1e-6;
+	std::cout << "Accumulating " << nRows << " rows of " << nChannels << " channels into " << nBaselines << " baselines.\n";
+	Buffers reference(nBaselines, nOutputValues);
+	run(ScalarKernel, nRows, nBaselines, nChannels, freqAvgFactor, data.get(), flags, weights.get(), reference);
+	for(Kernel kernel : kernels)
+	{
+		Buffers buffers(nBaselines, nOutputValues);
+		const double seconds = run(kernel, nRows, nBaselines, nChannels, freqAvgFactor, data.get(), flags, weights.get(), buffers);
+		std::cout << kernelName(kernel) << ": " << seconds << " s, " << (nRows / seconds * 1e-6) << " Mrows/s, " << (megaBytes / seconds) << " MB/s input";
+		// The legacy kernel has different flag semantics, so its averages are not compared
+		if(kernel != LegacySSEKernel)
+			std::cout << ", max. relative difference with scalar: " << compare(reference, buffers);
+		std::cout << '\n';
+	}
+	return 0;
+}
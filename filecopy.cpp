@@ -0,0 +1,166 @@
+#include "filecopy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/falloc.h>
+
+namespace {
+	
+const size_t bufferSize = 64*1024*1024;
+
+std::runtime_error errnoError(const std::string& message)
+{
+	return std::runtime_error(message + ": " + std::strerror(errno));
+}
+
+// True when the error means the call is not supported for these files,
+// so that the next method should be tried.
+bool isUnsupported(int error)
+{
+	return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+}
+
+/**
+ * Returns the number of bytes copied with copy_file_range(), which is
+ * less than count if it is not supported for these files.
+ */
+uint64_t kernelCopy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t count)
+{
+#ifdef __NR_copy_file_range
+	uint64_t copied = 0;
+	while(copied != count)
+	{
+		loff_t inPos = inOffset + copied, outPos = outOffset + copied;
+		// Called through syscall(), because older C libraries do not wrap it
+		ssize_t result = syscall(__NR_copy_file_range, inFd, &inPos, outFd, &outPos, count - copied, 0u);
+		if(result < 0)
+		{
+			if(copied == 0 && isUnsupported(errno))
+				return 0;
+			throw errnoError("copy_file_range() failed");
+		}
+		if(result == 0)
+			throw std::runtime_error("Unexpected end of input file");
+		copied += result;
+	}
+	return copied;
+#else
+	return 0;
+#endif
+}
+
+void bufferedCopy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t count)
+{
+	std::vector<char> buffer(std::min<uint64_t>(bufferSize, count));
+	uint64_t copied = 0;
+	while(copied != count)
+	{
+		const size_t size = std::min<uint64_t>(buffer.size(), count - copied);
+		size_t bufferPos = 0;
+		while(bufferPos != size)
+		{
+			ssize_t result = pread(inFd, &buffer[bufferPos], size - bufferPos, inOffset + copied + bufferPos);
+			if(result < 0)
+				throw errnoError("Error reading input file");
+			if(result == 0)
+				throw std::runtime_error("Unexpected end of input file");
+			bufferPos += result;
+		}
+		bufferPos = 0;
+		while(bufferPos != size)
+		{
+			ssize_t result = pwrite(outFd, &buffer[bufferPos], size - bufferPos, outOffset + copied + bufferPos);
+			if(result < 0)
+				throw errnoError("Error writing output file");
+			bufferPos += result;
+		}
+		copied += size;
+	}
+}
+
+/**
+ * Copies [start, end) of fd to a temporary file in the directory of filename,
+ * and renames it over filename. Until the rename, filename is not changed.
+ */
+void replaceByCopy(const std::string& filename, int fd, mode_t mode, uint64_t start, uint64_t end)
+{
+	std::string tempFilename = filename + ".XXXXXX";
+	int tempFd = mkstemp(&tempFilename[0]);
+	if(tempFd < 0)
+		throw errnoError("Could not create temporary file next to " + filename);
+	try {
+		if(fchmod(tempFd, mode & 07777) != 0)
+			throw errnoError("Could not set permissions of " + tempFilename);
+		CopyFileRange(fd, start, tempFd, 0, end - start);
+		if(fsync(tempFd) != 0)
+			throw errnoError("Could not write " + tempFilename);
+		if(close(tempFd) != 0)
+		{
+			tempFd = -1;
+			throw errnoError("Could not write " + tempFilename);
+		}
+		tempFd = -1;
+		if(rename(tempFilename.c_str(), filename.c_str()) != 0)
+			throw errnoError("Could not replace " + filename);
+	} catch(...) {
+		if(tempFd >= 0)
+			close(tempFd);
+		unlink(tempFilename.c_str());
+		throw;
+	}
+}
+
+} // anonymous namespace
+
+void CopyFileRange(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t count)
+{
+	if(count == 0)
+		return;
+	if(kernelCopy(inFd, inOffset, outFd, outOffset, count) == count)
+		return;
+	// sendfile() is not used, because it writes at the file offset of outFd,
+	// which is shared when several threads copy to the same file.
+	bufferedCopy(inFd, inOffset, outFd, outOffset, count);
+}
+
+void TrimFileInPlace(const std::string& filename, uint64_t start, uint64_t end)
+{
+	int fd = open(filename.c_str(), O_RDWR);
+	if(fd < 0)
+		throw errnoError("Could not open " + filename);
+	try {
+		struct stat fileStat;
+		if(fstat(fd, &fileStat) != 0)
+			throw errnoError("Could not stat " + filename);
+		bool isTrimmed = false;
+		// The collapse can only remove whole blocks
+		if(start % fileStat.st_blksize == 0)
+		{
+			if(ftruncate(fd, end) != 0)
+				throw errnoError("Could not truncate " + filename);
+			if(start == 0 || fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, start) == 0)
+				isTrimmed = true;
+			else if(errno != EINVAL && errno != EOPNOTSUPP)
+				throw errnoError("Could not remove start of " + filename);
+		}
+		if(!isTrimmed)
+		{
+			std::cout << "The start of the file can not be removed directly; replacing the file by a copy of the selection.\n";
+			replaceByCopy(filename, fd, fileStat.st_mode, start, end);
+		}
+	} catch(...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+}
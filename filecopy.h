@@ -0,0 +1,27 @@
+#ifndef FILE_COPY_H
+#define FILE_COPY_H
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Copies count bytes from inFd at inOffset to outFd at outOffset. The copy is
+ * done by the kernel with copy_file_range() when possible, which can share the
+ * data blocks on reflink-capable file systems (XFS, Btrfs) instead of copying
+ * them. Otherwise, large buffered reads and writes are used. The file offsets
+ * of the descriptors are neither used nor changed, so several threads can copy
+ * to different ranges of the same output descriptor. Throws on error.
+ */
+void CopyFileRange(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t count);
+
+/**
+ * Reduces a file to the byte range [start, end). When start is a multiple of
+ * the file system block size, the end is removed by truncating and the start
+ * with fallocate(FALLOC_FL_COLLAPSE_RANGE). When start is not aligned or the
+ * file system does not support the collapse, the range is copied to a
+ * temporary file in the same directory, which is then renamed over the file;
+ * this needs space for the copy, unless the file system supports reflinks.
+ */
+void TrimFileInPlace(const std::string& filename, uint64_t start, uint64_t end);
+
+#endif
@@ -1,10 +1,30 @@
 #include "fitswriter.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#define USE_SSE
 
 #define VLIGHT 299792458.0  // speed of light in m/s
 
-FitsWriter::FitsWriter(const std::string& filename) : _nRowsWritten(0), _groupHeadersInitialized(false)
+FitsWriter::FitsWriter(const std::string& filename) :
+	_nRowsWritten(0),
+	_nReservedRows(0),
+	_nRowsInHeader(0),
+	_groupHeadersInitialized(false),
+	_isFinished(false),
+	_polarizationMode(LinearPolarizations),
+	_groupBuffer(empty_aligned<float>()),
+	_groupBufferCapacity(0),
+	_nGroupsInBuffer(0),
+	_channelSpacing(0.0)
 {
 	/** If the file already exists, remove it */
 	FILE *fp = std::fopen(filename.c_str(), "r");
@@ -20,12 +40,36 @@ FitsWriter::FitsWriter(const std::string& filename) : _nRowsWritten(0), _groupHe
 
 FitsWriter::~FitsWriter()
 {
-	setKeywordToInt("GCOUNT", _nRowsWritten);
+	if(!_isFinished)
+	{
+		try {
+			Finish();
+		} catch(std::exception& e) {
+			std::cerr << "Error while finishing UVFITS file: " << e.what() << '\n';
+		}
+	}
+	// Finish() might have failed before the file was closed
+	if(_fptr != nullptr)
+	{
+		int status = 0;
+		fits_close_file(_fptr, &status);
+	}
+}
+
+void FitsWriter::Finish()
+{
+	_isFinished = true;
+	flushGroups();
+	if(_nRowsWritten != _nRowsInHeader)
+		setKeywordToInt("GCOUNT", _nRowsWritten);
 	
 	writeAntennaTable();
 	
+	// The file is released by CFITSIO, also when closing fails
+	fitsfile* fptr = _fptr;
+	_fptr = nullptr;
 	int status = 0;
-	if(fits_close_file(_fptr, &status))
+	if(fits_close_file(fptr, &status))
 		throwError(status, std::string("Cannot close file "));
 }
 
@@ -43,21 +87,25 @@ void FitsWriter::initGroupHeader()
 	 * This call will set the keywords
 	 * - PCOUNT=5
 	 * - GROUPS=T
-	 * - GCOUNT=nr baselines x time step count
+	 * - GCOUNT=nr baselines x time step count (if the number of rows was reserved,
+	 * otherwise it is updated when the file is closed)
 	 */
 	const unsigned NAXIS = 6;
 	long naxes[NAXIS];
   naxes[0] = 0;
   naxes[1] = 3;  // real, imaginary, weight
-  naxes[2] = 4;  // polarization count
+  naxes[2] = PolarizationCount(_polarizationMode);
   naxes[3] = _bandInfo.channels.size();
   naxes[4] = 1;
   naxes[5] = 1;
 	const unsigned nGroupParams = 5; // u,v,w,baseline,time
-	// Total number of rows: don't know yet, start with one timestep.
-	const unsigned nRows = _antennae.size() * (_antennae.size() + 1) / 2;
+	// Total number of rows: if not known, start with one timestep.
+	if(_nReservedRows != 0)
+		_nRowsInHeader = _nReservedRows;
+	else
+		_nRowsInHeader = _antennae.size() * (_antennae.size() + 1) / 2;
   fits_write_grphdr(_fptr, TRUE, FLOAT_IMG, NAXIS, naxes, nGroupParams,
-										nRows, TRUE, &status);
+										_nRowsInHeader, TRUE, &status);
 	checkStatus(status);
 	
   setKeywordToFloat("BSCALE", 1.0);
@@ -97,13 +145,20 @@ void FitsWriter::initGroupHeader()
   setKeywordToFloat("CDELT2", 1.0);
 	
   setKeywordToString("CTYPE3", "STOKES");
-	setKeywordToFloat("CRVAL3", -5); // Pol type = -5 : linear polarizations
-	setKeywordToFloat("CDELT3", -1); // Required for linear pols
+	if(_polarizationMode == StokesIPolarization)
+	{
+		setKeywordToFloat("CRVAL3", 1); // Pol type = 1 : Stokes I
+		setKeywordToFloat("CDELT3", 1);
+	}
+	else {
+		setKeywordToFloat("CRVAL3", -5); // Pol type = -5 : linear polarizations
+		setKeywordToFloat("CDELT3", -1); // Required for linear pols
+	}
   setKeywordToFloat("CRPIX3", 1.0);
 	
 	setKeywordToString("CTYPE4", "FREQ");
   setKeywordToFloat("CRVAL4", (_bandInfo.channels[_bandInfo.channels.size()/2].chanFreq));
-  setKeywordToFloat("CDELT4", _bandInfo.totalBandwidth / (double) _bandInfo.channels.size());
+  setKeywordToFloat("CDELT4", _channelSpacing);
   setKeywordToFloat("CRPIX4", _bandInfo.channels.size()/2 + 1);
 
 	const double
@@ -150,6 +205,22 @@ void FitsWriter::WriteBandInfo(const std::string& name, const std::vector<Channe
 	_bandInfo.refFreq = refFreq;
 	_bandInfo.totalBandwidth = totalBandwidth;
 	_bandInfo.flagRow = flagRow;
+	
+	// The frequency axis of the random groups is described by a start and
+	// increment, so the channels should be equally spaced.
+	if(channels.size() > 1)
+	{
+		_channelSpacing = (channels.back().chanFreq - channels.front().chanFreq) / double(channels.size() - 1);
+		for(size_t ch=0; ch!=channels.size(); ++ch)
+		{
+			const double expected = channels.front().chanFreq + _channelSpacing * ch;
+			if(std::fabs(channels[ch].chanFreq - expected) > 1e-3 * std::fabs(_channelSpacing))
+				throw std::runtime_error("UVFITS output requires channels with a regular frequency spacing; select channels from subbands that are adjacent");
+		}
+	}
+	else if(!channels.empty()) {
+		_channelSpacing = channels.front().chanWidth;
+	}
 }
 
 void FitsWriter::WriteAntennae(const std::vector<AntennaInfo>& antennae, double time)
@@ -158,8 +229,9 @@ void FitsWriter::WriteAntennae(const std::vector<AntennaInfo>& antennae, double
 	_antennaDate = time;
 }
 
-void FitsWriter::WritePolarizationForLinearPols(bool flagRow)
+void FitsWriter::WritePolarizations(PolarizationMode mode, bool flagRow)
 {
+	_polarizationMode = mode;
 }
 
 void FitsWriter::WriteField(const FieldInfo& field)
@@ -188,19 +260,21 @@ void FitsWriter::WriteHistoryItem(const std::string &commandLine, const std::str
 void FitsWriter::AddRows(size_t count)
 {
 	if(!_groupHeadersInitialized)
+	{
 		initGroupHeader();
+		
+		// Collect about 8 MB of groups before writing them
+		_groupBufferCapacity = std::max<size_t>(1, (8*1024*1024) / (groupSize() * sizeof(float)));
+		_groupBuffer = make_aligned<float>(_groupBufferCapacity * groupSize(), 16);
+	}
 }
 
 void FitsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
-	const size_t nGroupParameters = 5;
+	if(_nGroupsInBuffer == _groupBufferCapacity)
+		flushGroups();
 	
-	// 3 dimensions (real,imag,weight), 4 pol, nch
-	const size_t nElements = 3 * 4 * _bandInfo.channels.size();
-	
-	// TODO might be efficient to declare this outside function
-	std::vector<float> rowData(nElements + nGroupParameters); 
-
+	float *rowData = &_groupBuffer[_nGroupsInBuffer * groupSize()];
 	rowData[0] = u / VLIGHT;
 	rowData[1] = v / VLIGHT;
 	rowData[2] = w / VLIGHT;
@@ -208,12 +282,29 @@ void FitsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, siz
 	double zeroTimeLevel = timeZeroLevel();
 	rowData[4] = time / (60.0*60.0*24.0) + 2400000.5 - zeroTimeLevel;
 
+	// Visibilities are reordered to (real, imag, weight) x (XX, YY, XY, YX),
+	// and the weights of flagged visibilities are made negative.
 	float *rowDataPtr = &rowData[5];
 	const float *weightPtr = weights;
 	const bool *flagPtr = flags;
 	const std::complex<float> *dataPtr = data;
+	if(_polarizationMode != LinearPolarizations)
+	{
+		// XX, YY and I are already in FITS order
+		const size_t nValues = PolarizationCount(_polarizationMode) * _bandInfo.channels.size();
+		for(size_t i=0; i!=nValues; ++i)
+		{
+			rowDataPtr[0] = dataPtr[i].real();
+			rowDataPtr[1] = dataPtr[i].imag();
+			rowDataPtr[2] = flagPtr[i] ? -weightPtr[i] : weightPtr[i];
+			rowDataPtr += 3;
+		}
+		++_nGroupsInBuffer;
+		return;
+	}
 	for(size_t ch=0; ch != _bandInfo.channels.size(); ++ch)
 	{
+#ifndef USE_SSE
 		const std::complex<float> xx = *dataPtr; ++dataPtr;
 		const std::complex<float> xy = *dataPtr; ++dataPtr;
 		const std::complex<float> yx = *dataPtr; ++dataPtr;
@@ -250,12 +341,48 @@ void FitsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, siz
 		++rowDataPtr;
 		*rowDataPtr = weightYX;
 		++rowDataPtr;
+#else
+		// a = (xx.r, xx.i, xy.r, xy.i), b = (yx.r, yx.i, yy.r, yy.i)
+		const __m128 a = _mm_loadu_ps(reinterpret_cast<const float*>(dataPtr));
+		const __m128 b = _mm_loadu_ps(reinterpret_cast<const float*>(dataPtr+2));
+		// Flip the sign bit of the weights of flagged visibilities
+		const __m128 signs = _mm_castsi128_ps(_mm_slli_epi32(
+			_mm_setr_epi32(flagPtr[0], flagPtr[1], flagPtr[2], flagPtr[3]), 31));
+		const __m128 wgt = _mm_xor_ps(_mm_loadu_ps(weightPtr), signs);
+		
+		// (xx.r, xx.i, w.xx, yy.r)
+		const __m128 wxxyy = _mm_shuffle_ps(wgt, b, _MM_SHUFFLE(2, 2, 0, 0));
+		_mm_storeu_ps(rowDataPtr, _mm_shuffle_ps(a, wxxyy, _MM_SHUFFLE(2, 0, 1, 0)));
+		// (yy.i, w.yy, xy.r, xy.i)
+		const __m128 yywyy = _mm_shuffle_ps(b, wgt, _MM_SHUFFLE(3, 3, 3, 3));
+		_mm_storeu_ps(rowDataPtr+4, _mm_shuffle_ps(yywyy, a, _MM_SHUFFLE(3, 2, 2, 0)));
+		// (w.xy, yx.r, yx.i, w.yx)
+		const __m128 wxyyx = _mm_shuffle_ps(wgt, b, _MM_SHUFFLE(0, 0, 1, 1));
+		const __m128 yxwyx = _mm_shuffle_ps(b, wgt, _MM_SHUFFLE(2, 2, 1, 1));
+		_mm_storeu_ps(rowDataPtr+8, _mm_shuffle_ps(wxyyx, yxwyx, _MM_SHUFFLE(2, 0, 2, 0)));
+		
+		rowDataPtr += 12;
+		dataPtr += 4;
+		weightPtr += 4;
+		flagPtr += 4;
+#endif
 	}
 	
-	int status = 0;
-	++_nRowsWritten;
-	fits_write_grppar_flt(_fptr, _nRowsWritten, 1 ,nElements + nGroupParameters, &rowData[0], &status);
-	checkStatus(status);
+	++_nGroupsInBuffer;
+}
+
+void FitsWriter::flushGroups()
+{
+	if(_nGroupsInBuffer != 0)
+	{
+		// Random groups are stored consecutively, so a block of groups can be
+		// written as one range of elements, starting at the first group.
+		int status = 0;
+		fits_write_grppar_flt(_fptr, _nRowsWritten+1, 1, _nGroupsInBuffer * groupSize(), _groupBuffer.get(), &status);
+		checkStatus(status);
+		_nRowsWritten += _nGroupsInBuffer;
+		_nGroupsInBuffer = 0;
+	}
 }
 
 void FitsWriter::writeAntennaTable()
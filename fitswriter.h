@@ -1,6 +1,7 @@
 #ifndef FITSWRITER_H
 #define FITSWRITER_H
 
+#include "aligned_ptr.h"
 #include "fitsuser.h"
 #include "writer.h"
 
@@ -18,7 +19,7 @@ class FitsWriter : public Writer, private FitsUser
 		
 		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
-		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) final override;
 		virtual void WriteField(const FieldInfo& field) final override;
 		virtual void WriteSource(const SourceInfo &source) final override;
 		virtual void WriteObservation(const ObservationInfo& observation) final override;
@@ -30,13 +31,25 @@ class FitsWriter : public Writer, private FitsUser
 			_arrayZ = z;
 		}
 		
+		virtual void ReserveRows(size_t count) final override
+		{
+			_nReservedRows = count;
+		}
 		virtual void AddRows(size_t count) final override;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Finish() final override;
 		virtual bool AreAntennaPositionsLocal() const final override { return true; }
 		
 	private:
 		void initGroupHeader();
 		void writeAntennaTable();
+		void flushGroups();
+		
+		size_t groupSize() const
+		{
+			// 5 group parameters; 3 dimensions (real,imag,weight), npol, nch
+			return 5 + 3 * PolarizationCount(_polarizationMode) * _bandInfo.channels.size();
+		}
 		
 		void setKeywordToDouble(const char *keywordName, double value) const
 		{
@@ -95,8 +108,13 @@ class FitsWriter : public Writer, private FitsUser
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
 		std::string _telescopeName;
-		size_t _nRowsWritten;
-		bool _groupHeadersInitialized;
+		size_t _nRowsWritten, _nReservedRows, _nRowsInHeader;
+		bool _groupHeadersInitialized, _isFinished;
+		PolarizationMode _polarizationMode;
+		
+		// Random groups are collected in this buffer and written in blocks
+		aligned_ptr<float> _groupBuffer;
+		size_t _groupBufferCapacity, _nGroupsInBuffer;
 		
 		struct {
 			std::string name;
@@ -105,6 +123,7 @@ class FitsWriter : public Writer, private FitsUser
 			double totalBandwidth;
 			bool flagRow;
 		} _bandInfo;
+		double _channelSpacing;
 		
 		double _fieldRA, _fieldDec;
 		double _startTime;
@@ -26,9 +26,9 @@ class ForwardingWriter : public Writer
 			_writer->WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
 		}
 
-		virtual void WritePolarizationForLinearPols(bool flagRow) override
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) override
 		{
-			_writer->WritePolarizationForLinearPols(flagRow);
+			_writer->WritePolarizations(mode, flagRow);
 		}
 		
 		virtual void WriteSource(const Writer::SourceInfo &source) override
@@ -56,6 +56,21 @@ class ForwardingWriter : public Writer
 			_writer->SetOffsetsPerGPUBox(offsets);
 		}
 		
+		virtual void SetBaselineSelection(const std::vector<std::pair<size_t, size_t>>& baselines) override
+		{
+			_writer->SetBaselineSelection(baselines);
+		}
+		
+		virtual void ReserveRows(size_t rowCount) override
+		{
+			_writer->ReserveRows(rowCount);
+		}
+		
+		virtual void ReserveBaselineRows(const std::vector<BaselineRowCount>& rowCounts) override
+		{
+			_writer->ReserveBaselineRows(rowCounts);
+		}
+		
 		virtual void AddRows(size_t rowCount) override
 		{
 			_writer->AddRows(rowCount);
@@ -71,6 +86,11 @@ class ForwardingWriter : public Writer
 			_writer->WriteHistoryItem(commandLine, application, params);
 		}
 		
+		virtual void Finish() override
+		{
+			_writer->Finish();
+		}
+		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) override {
 			return _writer->IsTimeAligned(antenna1, antenna2);
 		}
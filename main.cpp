@@ -4,9 +4,13 @@
 
 #include "units/radeccoord.h"
 
+#include <sstream>
+
 void printSyntax()
 {
-  std::cout << "\nSyntax: aartfaac2ms [options] <input.vis> <output.ms> <antennas.conf>\n\n"
+  std::cout << "\nSyntax: aartfaac2ms [options] <input.vis> [<input2.vis> ...] <output.ms> <antennas.conf>\n\n"
+  "Multiple input files are treated as subbands of the same observation: their\n"
+  "channels are combined into a single band in the output.\n\n"
   "Options:\n"
   "  -mem <percentage>\n"
   "\tLimit memory usage to the given fraction of the total system memory. \n"
@@ -16,18 +20,71 @@ void printSyntax()
   "\tAverage in time (after flagging).\n"
   "  -freq-avg <factor>\n"
   "\tAverage in frequency (after flagging).\n"
+  "  -early-avg\n"
+  "\tPerform the time and frequency averaging per baseline directly after flagging,\n"
+  "\tbefore phase rotation. This is faster, but can not be combined with -bda.\n"
+  "  -bda <decorrelation>\n"
+  "\tBaseline-dependent averaging: average each baseline in time as much as possible\n"
+  "\twhile keeping the decorrelation of a source on the horizon below the given\n"
+  "\tfraction (e.g. 0.02). The factor given with -time-avg is the maximum factor.\n"
   "  -interval <start> <end>\n"
   "\tOnly convert the selected timesteps.\n"
+  "  -follow <chunk size> <timeout>\n"
+  "\tFollow input files that are still being written. Chunks of the given number of\n"
+  "\ttimesteps are processed as soon as they have arrived. Conversion ends when the\n"
+  "\tinput has not grown for the given number of seconds. Only for regular files\n"
+  "\tand measurement set output.\n"
+  "  -direct-io\n"
+  "\tRead the input with direct I/O in large blocks, bypassing the page cache. This\n"
+  "\tavoids evicting other data from memory for input that is read only once.\n"
+  "  -async-read <queue depth>\n"
+  "\tRead up to the given number of timesteps at the same time, which is faster on\n"
+  "\tstorage that needs many outstanding requests, such as NVMe arrays. Uses io_uring\n"
+  "\twhen available, otherwise a thread per outstanding read. Can not be combined\n"
+  "\twith -direct-io.\n"
+  "  -channels <start> <end> <step>\n"
+  "\tOnly convert channels start, start+step, ... up to (not including) end. An end\n"
+  "\tof 0 selects up to the last channel. Other channels are skipped while reading,\n"
+  "\tso they are not flagged and do not take memory.\n"
   "  -flag / -no-flag\n"
   "\tTurn RFI detection on/off. Default is currently off, but this might change.\n"
   "  -statistics / -no-statistics\n"
   "\tTurn collecting of quality on/off. Default is on. The statistics can be viewed\n"
   "\twith aoqplot.\n"
+  "  -exclude-antennas <list>\n"
+  "\tLeave out all baselines with the given antennas, given as a comma-separated\n"
+  "\tlist of antenna indices, e.g. -exclude-antennas 3,17,120.\n"
+  "  -min-baseline <meters> / -max-baseline <meters>\n"
+  "\tOnly convert cross-correlations of which the baseline length is in the given\n"
+  "\trange. Auto-correlations are always kept. Baselines that are left out are not\n"
+  "\tread, flagged or written, which saves memory and processing time.\n"
+  "  -detect-bad-antennas\n"
+  "\tDetermine the auto-correlation power of each antenna from a sample of timesteps,\n"
+  "\tand flag all baselines of antennas that are dead or have outlying power.\n"
+  "\tThese baselines are not processed by the flagging strategy.\n"
+  "  -omit-bad-antennas\n"
+  "\tAs -detect-bad-antennas, but leave the bad antennas out of the output.\n"
   "  -centre <ra> <dec>\n"
   "\tSet alternative phase centre, e.g. -centre 00h00m00.0s 00d00m00.0s.\n"
+  "  -output-format <ms|uvfits|raw>\n"
+  "\tSet the output format. Default is ms. The raw format is a simple columnar\n"
+  "\tformat that can be memory mapped, and converted to a measurement set with\n"
+  "\traw2ms.\n"
+  "  -pol <linear|xxyy|i>\n"
+  "\tSet the written polarizations: all four linear correlations (default), only\n"
+  "\tXX and YY, or only Stokes I. Polarizations are combined after flagging.\n"
+  "  -shards <count>\n"
+  "\tWrite the output as the given number of parts, split by baseline, each written\n"
+  "\tfrom its own thread. Measurement set parts are concatenated into the output\n"
+  "\tmeasurement set. This concatenation refers to the rows of the parts, so the\n"
+  "\tparts should be kept next to it. Its rows are ordered by part, i.e. by antenna\n"
+  "\trange, and are only in time order within each part. Tools that expect the\n"
+  "\trows to be sorted in time should be given the parts, or a copy that is sorted\n"
+  "\ton time. UVFITS parts are kept as separate files.\n"
   "  -use-dysco\n"
   "\tCompress the measurement set with Dysco, using default settings (unless\n"
-  "\tspecified with -dysco-config).\n"
+  "\tspecified with -dysco-config). A measurement set is compressed on a single\n"
+  "\tthread; with -shards, every part is compressed on its own thread.\n"
   "  -dysco-config <data bits> <weight bits> <distribution> <truncation> <normalization>\n"
   "\tOverride default dysco settings.\n"
   "  -version\n"
@@ -47,6 +104,7 @@ int main(int argc, char* argv[])
 	Aartfaac2ms af2ms;
 	AartfaacMode mode(AartfaacMode::Unused);
 	size_t nCPUs = 0;
+	double minBaselineLength = 0.0, maxBaselineLength = 0.0;
 	while(argi<argc && argv[argi][0] == '-')
 	{
     const size_t parameterStart = argv[argi][1] == '-' ? 2 : 1;
@@ -75,10 +133,58 @@ int main(int argc, char* argv[])
 			++argi;
 			af2ms.SetFrequencyAveraging(std::atoi(argv[argi]));
 		}
+		else if(param == "early-avg") {
+			af2ms.SetEarlyAveraging(true);
+		}
+		else if(param == "bda") {
+			++argi;
+			af2ms.SetBaselineDependentAveraging(std::atof(argv[argi]));
+		}
 		else if(param == "interval") {
 			af2ms.SetInterval(std::atoi(argv[argi+1]), std::atoi(argv[argi+2]));
 			argi+=2;
 		}
+		else if(param == "follow") {
+			const size_t chunkSize = std::atoi(argv[argi+1]);
+			if(chunkSize == 0)
+				throw std::runtime_error("Chunk size for -follow should be at least one timestep");
+			af2ms.SetFollowMode(chunkSize, std::atof(argv[argi+2]));
+			argi+=2;
+		}
+		else if(param == "direct-io") {
+			af2ms.SetDirectIO(true);
+		}
+		else if(param == "async-read") {
+			++argi;
+			af2ms.SetAsyncReadDepth(std::atoi(argv[argi]));
+		}
+		else if(param == "channels") {
+			af2ms.SetChannelSelection(std::atoi(argv[argi+1]), std::atoi(argv[argi+2]), std::atoi(argv[argi+3]));
+			argi+=3;
+		}
+		else if(param == "exclude-antennas") {
+			++argi;
+			std::vector<size_t> antennas;
+			std::istringstream list(argv[argi]);
+			std::string antenna;
+			while(std::getline(list, antenna, ','))
+				antennas.emplace_back(std::atoi(antenna.c_str()));
+			af2ms.SetExcludedAntennas(antennas);
+		}
+		else if(param == "min-baseline") {
+			++argi;
+			minBaselineLength = std::atof(argv[argi]);
+		}
+		else if(param == "max-baseline") {
+			++argi;
+			maxBaselineLength = std::atof(argv[argi]);
+		}
+		else if(param == "detect-bad-antennas") {
+			af2ms.SetBadAntennaDetection(true, false);
+		}
+		else if(param == "omit-bad-antennas") {
+			af2ms.SetBadAntennaDetection(true, true);
+		}
 		else if(param == "centre") {
 			++argi;
 			long double centreRA = RaDecCoord::ParseRA(argv[argi]);
@@ -86,6 +192,37 @@ int main(int argc, char* argv[])
 			long double centreDec = RaDecCoord::ParseDec(argv[argi]);
 			af2ms.SetPhaseCentre(centreRA, centreDec);
 		}
+		else if(param == "output-format") {
+			++argi;
+			const std::string format(argv[argi]);
+			if(format == "ms")
+				af2ms.SetOutputFormat(Aartfaac2ms::MSOutputFormat);
+			else if(format == "uvfits")
+				af2ms.SetOutputFormat(Aartfaac2ms::FitsOutputFormat);
+			else if(format == "raw")
+				af2ms.SetOutputFormat(Aartfaac2ms::RawOutputFormat);
+			else
+				throw std::runtime_error("Invalid output format: " + format);
+		}
+		else if(param == "pol") {
+			++argi;
+			const std::string pol(argv[argi]);
+			if(pol == "linear")
+				af2ms.SetPolarizationMode(Writer::LinearPolarizations);
+			else if(pol == "xxyy")
+				af2ms.SetPolarizationMode(Writer::DiagonalPolarizations);
+			else if(pol == "i")
+				af2ms.SetPolarizationMode(Writer::StokesIPolarization);
+			else
+				throw std::runtime_error("Invalid polarization mode: " + pol);
+		}
+		else if(param == "shards") {
+			++argi;
+			const int shardCount = std::atoi(argv[argi]);
+			if(shardCount < 1)
+				throw std::runtime_error("Number of shards should be at least one");
+			af2ms.SetShardCount(shardCount);
+		}
 		else if(param == "use-dysco")
 		{
 			af2ms.SetUseDysco(true);
@@ -109,13 +246,15 @@ int main(int argc, char* argv[])
     printSyntax();
     throw std::runtime_error("Insufficient parameters provided, need at least input, output and antenna-config");
 	}
+	af2ms.SetBaselineLengthRange(minBaselineLength, maxBaselineLength);
 	if(nCPUs == 0)
 		af2ms.SetThreadCount(sysconf(_SC_NPROCESSORS_ONLN));
 	else
 		af2ms.SetThreadCount(nCPUs);
 	if(mode == AartfaacMode::Unused)
 		throw std::runtime_error("Mode not set. Valid modes are 1-7.");
-	af2ms.Run(argv[argi], argv[argi+1], argv[argi+2], mode);
+	const std::vector<std::string> inputFilenames(argv + argi, argv + argc - 2);
+	af2ms.Run(inputFilenames, argv[argc-2], argv[argc-1], mode);
 	return 0;
 }
 
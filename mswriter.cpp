@@ -1,5 +1,7 @@
 #include "mswriter.h"
 
+#include <aocommon/lane.h>
+
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
 #include <casacore/tables/DataMan/IncrementalStMan.h>
@@ -8,19 +10,86 @@
 #include <casacore/tables/Tables/ArrColDesc.h>
 #include <casacore/tables/Tables/ScalarColumn.h>
 #include <casacore/tables/Tables/SetupNewTab.h>
+#include <casacore/tables/Tables/Table.h>
 #include <casacore/tables/Tables/TableRecord.h>
 
+#include <casacore/casa/Containers/Block.h>
 #include <casacore/casa/Containers/Record.h>
 
+#include <casacore/casa/Arrays/ArrayMath.h>
 #include <casacore/casa/Arrays/Cube.h>
 
 #include <casacore/measures/TableMeasures/TableMeasDesc.h>
 
 #include <casacore/measures/Measures/MFrequency.h>
 
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 
 using namespace casacore;
 
+namespace {
+	/**
+	 * Returns a reference to the part of an array that holds the first rows,
+	 * i.e., the first positions along the last axis.
+	 */
+	template<typename T>
+	casacore::Array<T> firstRows(casacore::Array<T>& array, size_t nRows)
+	{
+		casacore::IPosition start(array.ndim(), 0), end(array.shape());
+		for(size_t i=0; i!=end.size(); ++i)
+			--end[i];
+		end[end.size()-1] = nRows-1;
+		return array(start, end);
+	}
+}
+
+/**
+ * A block of consecutive rows that is filled by WriteRow() and is
+ * written to the measurement set as a whole by the slice writing thread.
+ */
+struct MSWriterSlice
+{
+	MSWriterSlice() : _startRow(0), _rowCount(0), _usedRowCount(0), _nPol(0), _nChannels(0)
+	{ }
+	
+	// _rowCount is the capacity of the slice, of which the first
+	// _usedRowCount rows have been filled.
+	size_t _startRow, _rowCount, _usedRowCount, _nPol, _nChannels;
+	
+	casacore::Vector<double> _timeSlice, _timeCentroidSlice, _intervalSlice;
+	casacore::Vector<int> _ant1Slice, _ant2Slice;
+	casacore::Matrix<double> _uvwSlice;
+	casacore::Cube<casacore::Complex> _dataSlice;
+	casacore::Cube<bool> _flagSlice;
+	casacore::Cube<float> _weightSpectrumSlice;
+	casacore::Matrix<float> _weightsSlice;
+	
+	void Resize(size_t nPol, size_t nChannels, size_t rowCount)
+	{
+		// Slices are reused, and normally keep their shape
+		if(rowCount == _rowCount && nPol == _nPol && nChannels == _nChannels)
+			return;
+		_rowCount = rowCount;
+		_nPol = nPol;
+		_nChannels = nChannels;
+		_timeSlice.resize(rowCount);
+		_timeCentroidSlice.resize(rowCount);
+		_intervalSlice.resize(rowCount);
+		_ant1Slice.resize(rowCount);
+		_ant2Slice.resize(rowCount);
+		_uvwSlice.resize(3, rowCount);
+		_dataSlice.resize(nPol, nChannels, rowCount);
+		_flagSlice.resize(nPol, nChannels, rowCount);
+		_weightSpectrumSlice.resize(nPol, nChannels, rowCount);
+		_weightsSlice.resize(nPol, rowCount);
+	}
+};
+
 class MSWriterData
 {
 	public:
@@ -40,18 +109,27 @@ class MSWriterData
 		
 		casacore::Vector<float> _sigmaArr;
 		
-		casacore::Vector<int> _ant1Slice, _ant2Slice;
-		casacore::Matrix<double> _uvwSlice;
-		casacore::Cube<casacore::Complex> _dataSlice;
-		casacore::Cube<bool> _flagSlice;
-		casacore::Cube<float> _weightSpectrumSlice;
-		casacore::Matrix<float> _weightsSlice;
+		// The slice that is currently being filled, and the lanes that
+		// pass slices to and from the slice writing thread. While a slice
+		// is written (and compressed, when Dysco is used), the next one
+		// can be filled. Slices are written by a single thread, because
+		// casacore tables can not be written concurrently, and Dysco
+		// compresses the cells while they are put. One MSWriter therefore
+		// compresses on one core; to use more cores, the output is split
+		// over several MSWriters with a ShardedWriter.
+		std::unique_ptr<MSWriterSlice> _slice;
+		aocommon::Lane<std::unique_ptr<MSWriterSlice>> _filledSlices, _freeSlices;
+		std::thread _sliceWriteThread;
+		std::exception_ptr _sliceWriteException;
+		std::mutex _exceptionMutex;
+		// Time spent by the slice writing thread in writing (and compressing)
+		std::chrono::steady_clock::duration _sliceWriteTime;
 
 		size_t _dyscoDataBitRate, _dyscoWeightBitRate;
 		std::string _dyscoDistribution, _dyscoNormalization;
 		double _dyscoDistTruncation;
 		
-		MSWriterData() = default;
+		MSWriterData() : _sliceWriteTime(std::chrono::steady_clock::duration::zero()) { }
 		void GetDyscoSpec(casacore::Record& record) const;
 		
 private:
@@ -62,19 +140,25 @@ private:
 MSWriter::MSWriter(const std::string& filename) :
 	_data(new MSWriterData()),
 	_isInitialized(false),
+	_isFinished(false),
 	_rowIndex(0),
-	_sliceStart(0),
 	_filename(filename),
 	_useDysco(false),
-	_flushNeeded(false)
+	_polarizationMode(LinearPolarizations),
+	_flagPolarizationRow(false)
 {
 }
 
 MSWriter::~MSWriter()
 {
-	if(!_isInitialized)
-		initialize();
-	flush();
+	if(!_isFinished)
+	{
+		try {
+			Finish();
+		} catch(std::exception& e) {
+			std::cerr << "Error while finishing measurement set " << _filename << ": " << e.what() << '\n';
+		}
+	}
 }
 
 void MSWriter::EnableCompression(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization)
@@ -93,10 +177,11 @@ void MSWriter::initialize()
 	
 	TableDesc tableDesc = MS::requiredTableDesc();
 	
-	casacore::IPosition dataShape(2, 4, _bandInfo.channels.size());
-	tableDesc.rwColumnDesc("SIGMA").setShape(IPosition(1,4));
+	const size_t nPol = PolarizationCount(_polarizationMode);
+	casacore::IPosition dataShape(2, nPol, _bandInfo.channels.size());
+	tableDesc.rwColumnDesc("SIGMA").setShape(IPosition(1,nPol));
 	tableDesc.rwColumnDesc("SIGMA").setOptions(ColumnDesc::Option::FixedShape | ColumnDesc::Option::Direct);
-	tableDesc.rwColumnDesc("WEIGHT").setShape(IPosition(1,4));
+	tableDesc.rwColumnDesc("WEIGHT").setShape(IPosition(1,nPol));
 	tableDesc.rwColumnDesc("WEIGHT").setOptions(ColumnDesc::Option::FixedShape | ColumnDesc::Option::Direct);
 	tableDesc.rwColumnDesc("FLAG").setShape(dataShape);
 	tableDesc.rwColumnDesc("FLAG").setOptions(ColumnDesc::Option::FixedShape | ColumnDesc::Option::Direct);
@@ -195,18 +280,29 @@ void MSWriter::initialize()
 	_data->_weightSpectrumCol = ArrayColumn<float>(ms, MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
 	_data->_flagCol = ArrayColumn<bool>(ms, MS::columnName(casacore::MSMainEnums::FLAG));
 	
-	_data->_sigmaArr = casacore::Vector<float>(4);
-	for(size_t p=0; p!=4; ++p) _data->_sigmaArr[p] = 1.0;
+	_data->_sigmaArr = casacore::Vector<float>(nPol);
+	for(size_t p=0; p!=nPol; ++p) _data->_sigmaArr[p] = 1.0;
 	
 	writeBandInfo();
 	writeAntennae();
-	writePolarizationForLinearPols();
+	writePolarizations();
 	writeField();
 	writeSource();
 	writeObservation();
 	writeHistoryItem();
 }
 
+void MSWriter::startSliceWriter()
+{
+	// From here on, the table is only accessed by the slice writing thread.
+	const size_t nSlices = 2;
+	_data->_filledSlices.resize(nSlices);
+	_data->_freeSlices.resize(nSlices);
+	for(size_t i=0; i!=nSlices; ++i)
+		_data->_freeSlices.write(std::unique_ptr<MSWriterSlice>(new MSWriterSlice()));
+	_data->_sliceWriteThread = std::thread(&MSWriter::sliceWriteThreadFunc, this);
+}
+
 void MSWriterData::GetDyscoSpec(casacore::Record& dyscoSpec) const
 {
 	dyscoSpec.define ("distribution", _dyscoDistribution);
@@ -240,8 +336,9 @@ void MSWriter::WriteAntennae(const std::vector<AntennaInfo>& antennae, double ti
 	_antennaDate = time;
 }
 
-void MSWriter::WritePolarizationForLinearPols(bool flagRow)
+void MSWriter::WritePolarizations(PolarizationMode mode, bool flagRow)
 {
+	_polarizationMode = mode;
 	_flagPolarizationRow = flagRow;
 }
 
@@ -342,7 +439,7 @@ void MSWriter::writeAntennae()
 	writeFeedEntries();
 }
 
-void MSWriter::writePolarizationForLinearPols()
+void MSWriter::writePolarizations()
 {
 	MeasurementSet &ms = _data->_ms;
 	MSPolarization polTable = ms.polarization();
@@ -351,20 +448,35 @@ void MSWriter::writePolarizationForLinearPols()
 	ArrayColumn<int> corrProductCol = ArrayColumn<int>(polTable, polTable.columnName(MSPolarizationEnums::CORR_PRODUCT));
 	ScalarColumn<bool> flagRowCol = ScalarColumn<bool>(polTable, polTable.columnName(MSPolarizationEnums::FLAG_ROW));
 	
+	const size_t nPol = PolarizationCount(_polarizationMode);
 	size_t rowIndex = polTable.nrow();
 	polTable.addRow(1);
-	numCorrCol.put(rowIndex, 4);
-	
-	casacore::Vector<int> cTypeVec(4);
-	cTypeVec[0] = 9; cTypeVec[1] = 10; cTypeVec[2] = 11; cTypeVec[3] = 12;
-	corrTypeCol.put(rowIndex, cTypeVec);
+	numCorrCol.put(rowIndex, nPol);
 	
-	casacore::Array<int> cProdArr(IPosition(2, 2, 4));
+	// Stokes types: I=1, XX=9, XY=10, YX=11, YY=12
+	casacore::Vector<int> cTypeVec(nPol);
+	casacore::Array<int> cProdArr(IPosition(2, 2, nPol));
 	casacore::Array<int>::iterator i=cProdArr.begin();
-	*i = 0; ++i; *i = 0; ++i;
-	*i = 0; ++i; *i = 1; ++i;
-	*i = 1; ++i; *i = 0; ++i;
-	*i = 1; ++i; *i = 1;
+	switch(_polarizationMode)
+	{
+		case LinearPolarizations:
+			cTypeVec[0] = 9; cTypeVec[1] = 10; cTypeVec[2] = 11; cTypeVec[3] = 12;
+			*i = 0; ++i; *i = 0; ++i;
+			*i = 0; ++i; *i = 1; ++i;
+			*i = 1; ++i; *i = 0; ++i;
+			*i = 1; ++i; *i = 1;
+			break;
+		case DiagonalPolarizations:
+			cTypeVec[0] = 9; cTypeVec[1] = 12;
+			*i = 0; ++i; *i = 0; ++i;
+			*i = 1; ++i; *i = 1;
+			break;
+		case StokesIPolarization:
+			cTypeVec[0] = 1;
+			*i = 0; ++i; *i = 0;
+			break;
+	}
+	corrTypeCol.put(rowIndex, cTypeVec);
 	corrProductCol.put(rowIndex, cProdArr);
 	
 	flagRowCol.put(rowIndex, false);
@@ -534,73 +646,174 @@ void MSWriter::writeObservation()
 	flagRowCol.put(rowIndex, _observation.flagRow);
 }
 
+void MSWriter::ReserveRows(size_t count)
+{
+	if(!_isInitialized)
+		initialize();
+	if(_data->_sliceWriteThread.joinable())
+		throw std::runtime_error("MSWriter::ReserveRows() should be called before rows are added");
+	
+	// Rows that are reserved but not written have to be removed afterwards,
+	// so when the storage managers can not remove rows, the table is
+	// grown while writing instead.
+	if(_data->_ms.canRemoveRow())
+		growTable(count);
+}
+
 void MSWriter::AddRows(size_t count)
 {
-	flush();
+	if(!_isInitialized)
+		initialize();
+	if(!_data->_sliceWriteThread.joinable())
+		startSliceWriter();
+	
+	submitSlice();
+	rethrowSliceWriteException();
+	
+	// Blocks until the writing thread has released a slice
+	_data->_freeSlices.read(_data->_slice);
 	
+	const size_t nPol = PolarizationCount(_polarizationMode);
+	_data->_slice->_startRow = _rowIndex;
+	_data->_slice->Resize(nPol, _bandInfo.channels.size(), count);
+}
+
+void MSWriter::submitSlice()
+{
+	if(_data->_slice)
+	{
+		_data->_slice->_usedRowCount = _rowIndex - _data->_slice->_startRow;
+		_data->_filledSlices.write(std::move(_data->_slice));
+	}
+}
+
+void MSWriter::Finish()
+{
+	_isFinished = true;
 	if(!_isInitialized)
 		initialize();
-	_data->_ms.addRow(count);
+	if(_data->_sliceWriteThread.joinable())
+	{
+		submitSlice();
+		_data->_filledSlices.write_end();
+		_data->_sliceWriteThread.join();
+		rethrowSliceWriteException();
+		const double seconds = std::chrono::duration<double>(_data->_sliceWriteTime).count();
+		std::cout << "Writing " << _rowIndex << " rows to " << _filename << " took " << seconds << " s on its writing thread" << (_useDysco ? " (including Dysco compression).\n" : ".\n");
+	}
+	
+	// Remove rows that were reserved but never written
+	MeasurementSet& ms = _data->_ms;
+	if(ms.nrow() > _rowIndex)
+	{
+		if(!ms.canRemoveRow())
+			throw std::runtime_error("Reserved rows of the measurement set were not written and can not be removed");
+		casacore::Vector<casacore::uInt> unusedRows(ms.nrow() - _rowIndex);
+		indgen(unusedRows, casacore::uInt(_rowIndex));
+		ms.removeRow(unusedRows);
+	}
+}
 
-	size_t nPol = 4;
-	_sliceStart = _rowIndex;
-	_data->_ant1Slice.resize(count);
-	_data->_ant2Slice.resize(count);
-	_data->_uvwSlice.resize(3, count);
-	_data->_dataSlice.resize(nPol, _bandInfo.channels.size(), count);
-	_data->_flagSlice.resize(nPol, _bandInfo.channels.size(), count);
-	_data->_weightSpectrumSlice.resize(nPol, _bandInfo.channels.size(), count);
-	_data->_weightsSlice.resize(nPol, count);
+void MSWriter::rethrowSliceWriteException()
+{
+	std::lock_guard<std::mutex> lock(_data->_exceptionMutex);
+	if(_data->_sliceWriteException)
+	{
+		std::exception_ptr e = _data->_sliceWriteException;
+		_data->_sliceWriteException = std::exception_ptr();
+		std::rethrow_exception(e);
+	}
 }
 
-void MSWriter::flush()
+void MSWriter::sliceWriteThreadFunc()
 {
-	if(_flushNeeded)
+	std::unique_ptr<MSWriterSlice> slice;
+	while(_data->_filledSlices.read(slice))
 	{
-		RefRows rows(_sliceStart, _rowIndex-1, 1);
-		_data->_antenna1Col.putColumnCells(rows, _data->_ant1Slice);
-		_data->_antenna2Col.putColumnCells(rows, _data->_ant2Slice);
-		_data->_uvwCol.putColumnCells(rows, _data->_uvwSlice);
-		_data->_dataCol.putColumnCells(rows, _data->_dataSlice);
-		_data->_flagCol.putColumnCells(rows, _data->_flagSlice);
-		_data->_weightSpectrumCol.putColumnCells(rows, _data->_weightSpectrumSlice);
-		_data->_weightCol.putColumnCells(rows, _data->_weightsSlice);
-	
-		_flushNeeded = false;
+		try {
+			const auto start = std::chrono::steady_clock::now();
+			writeSlice(*slice);
+			_data->_sliceWriteTime += std::chrono::steady_clock::now() - start;
+		} catch(...) {
+			std::lock_guard<std::mutex> lock(_data->_exceptionMutex);
+			if(!_data->_sliceWriteException)
+				_data->_sliceWriteException = std::current_exception();
+		}
+		_data->_freeSlices.write(std::move(slice));
 	}
 }
 
-void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+void MSWriter::writeSlice(MSWriterSlice& slice)
+{
+	// AddRows() gives an upper limit, so not all rows need to be filled
+	const size_t n = slice._usedRowCount;
+	if(n == 0)
+		return;
+	
+	// Rows might already have been added by ReserveRows()
+	const size_t firstRow = slice._startRow;
+	growTable(firstRow + n);
+	
+	RefRows rows(firstRow, firstRow + n - 1, 1);
+	_data->_timeCol.putColumnCells(rows, Vector<double>(firstRows(slice._timeSlice, n)));
+	_data->_timeCentroidCol.putColumnCells(rows, Vector<double>(firstRows(slice._timeCentroidSlice, n)));
+	_data->_intervalCol.putColumnCells(rows, Vector<double>(firstRows(slice._intervalSlice, n)));
+	_data->_exposureCol.putColumnCells(rows, Vector<double>(firstRows(slice._intervalSlice, n)));
+	_data->_antenna1Col.putColumnCells(rows, Vector<int>(firstRows(slice._ant1Slice, n)));
+	_data->_antenna2Col.putColumnCells(rows, Vector<int>(firstRows(slice._ant2Slice, n)));
+	_data->_uvwCol.putColumnCells(rows, firstRows(slice._uvwSlice, n));
+	_data->_dataCol.putColumnCells(rows, firstRows(slice._dataSlice, n));
+	_data->_flagCol.putColumnCells(rows, firstRows(slice._flagSlice, n));
+	_data->_weightSpectrumCol.putColumnCells(rows, firstRows(slice._weightSpectrumSlice, n));
+	_data->_weightCol.putColumnCells(rows, firstRows(slice._weightsSlice, n));
+}
+
+void MSWriter::growTable(size_t rowCount)
 {
-	_flushNeeded = true;
-	if(antenna1==0 && antenna2==0)
+	// The incremental storage manager gives new rows the values of the last
+	// row, so the constant columns are set before the other rows are added.
+	MeasurementSet& ms = _data->_ms;
+	if(rowCount > ms.nrow())
 	{
-		_data->_timeCol.put(_rowIndex, time);
-		_data->_timeCentroidCol.put(_rowIndex, timeCentroid);
-		_data->_dataDescIdCol.put(_rowIndex, 0);
-		_data->_intervalCol.put(_rowIndex, interval);
-		_data->_exposureCol.put(_rowIndex, interval);
-		_data->_processorIdCol.put(_rowIndex, -1);
-		_data->_scanNumberCol.put(_rowIndex, 1);
-		_data->_stateIdCol.put(_rowIndex, -1);
-		_data->_sigmaCol.put(_rowIndex, _data->_sigmaArr);
+		if(ms.nrow() == 0)
+		{
+			ms.addRow(1);
+			writeConstantColumns(0);
+		}
+		ms.addRow(rowCount - ms.nrow());
 	}
-	
-	size_t indexInSlice = _rowIndex - _sliceStart;
-	_data->_ant1Slice[indexInSlice] = antenna1;
-	_data->_ant2Slice[indexInSlice] = antenna2;
-	_data->_uvwSlice.data()[indexInSlice*3+0] = u;
-	_data->_uvwSlice.data()[indexInSlice*3+1] = v;
-	_data->_uvwSlice.data()[indexInSlice*3+2] = w;
+}
 
-	size_t nPol = 4;
+void MSWriter::writeConstantColumns(size_t row)
+{
+	_data->_dataDescIdCol.put(row, 0);
+	_data->_processorIdCol.put(row, -1);
+	_data->_scanNumberCol.put(row, 1);
+	_data->_stateIdCol.put(row, -1);
+	_data->_sigmaCol.put(row, _data->_sigmaArr);
+}
+
+void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	MSWriterSlice& slice = *_data->_slice;
+	size_t indexInSlice = _rowIndex - slice._startRow;
+	slice._timeSlice[indexInSlice] = time;
+	slice._timeCentroidSlice[indexInSlice] = timeCentroid;
+	slice._intervalSlice[indexInSlice] = interval;
+	slice._ant1Slice[indexInSlice] = antenna1;
+	slice._ant2Slice[indexInSlice] = antenna2;
+	slice._uvwSlice.data()[indexInSlice*3+0] = u;
+	slice._uvwSlice.data()[indexInSlice*3+1] = v;
+	slice._uvwSlice.data()[indexInSlice*3+2] = w;
+
+	const size_t nPol = PolarizationCount(_polarizationMode);
 	
 	size_t valCount = _bandInfo.channels.size() * nPol;
 	
 	// Fill the casa arrays
-	std::complex<float>* dataPtr = _data->_dataSlice.data() + valCount*indexInSlice;
-	bool* flagPtr = _data->_flagSlice.data() + valCount*indexInSlice;
-	float* weightSpectrumPtr = _data->_weightSpectrumSlice.data() + valCount*indexInSlice;
+	std::complex<float>* dataPtr = slice._dataSlice.data() + valCount*indexInSlice;
+	bool* flagPtr = slice._flagSlice.data() + valCount*indexInSlice;
+	float* weightSpectrumPtr = slice._weightSpectrumSlice.data() + valCount*indexInSlice;
 	for(size_t i=0; i!=valCount; ++i)
 	{
 		*dataPtr = data[i]; ++dataPtr;
@@ -608,7 +821,7 @@ void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_
 		*weightSpectrumPtr = weights[i]; ++weightSpectrumPtr;
 	}
 	
-	float* weightsArr = _data->_weightsSlice.data() + nPol*indexInSlice;
+	float* weightsArr = slice._weightsSlice.data() + nPol*indexInSlice;
 	for(size_t p=0; p!=nPol; ++p) weightsArr[p] = 0.0;
 	for(size_t ch=0; ch!=_bandInfo.channels.size(); ++ch)
 	{
@@ -649,3 +862,13 @@ void MSWriter::writeHistoryItem()
 	parmsCol.put(rowIndex, appParamsVec);
 	cliCol.put(rowIndex, cliVec);
 }
+
+void MSWriter::Concatenate(const std::vector<std::string>& partFilenames, const std::string& filename)
+{
+	casacore::Block<casacore::Table> parts(partFilenames.size());
+	for(size_t i=0; i!=partFilenames.size(); ++i)
+		parts[i] = casacore::Table(partFilenames[i]);
+	// Subtables are taken from the first part; they are equal in all parts
+	casacore::Table concatenation(parts);
+	concatenation.rename(filename, casacore::Table::New);
+}
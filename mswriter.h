@@ -18,22 +18,34 @@ class MSWriter : public Writer
 		
 		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
-		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) final override;
 		virtual void WriteField(const FieldInfo& field) final override;
 		virtual void WriteSource(const SourceInfo &source) final override;
 		virtual void WriteObservation(const ObservationInfo& observation) final override;
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
 		
+		virtual void ReserveRows(size_t count) final override;
 		virtual void AddRows(size_t count) final override;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Finish() final override;
 		
 		virtual bool CanWriteStatistics() const final override
 		{
 			return true;
 		}
+		
+		/**
+		 * Combine measurement sets with equal subtables into a single
+		 * measurement set, e.g. the parts written by a ShardedWriter. The
+		 * result is a concatenation that refers to the parts, which should
+		 * therefore not be removed. The rows are not sorted: all rows of
+		 * the first part come first, so the main table of the result is
+		 * not in time order when the parts are split by baseline.
+		 */
+		static void Concatenate(const std::vector<std::string>& partFilenames, const std::string& filename);
 	private:
 		void writeDataDescEntry(size_t spectralWindowId, size_t polarizationId, bool flagRow);
-		void writePolarizationForLinearPols();
+		void writePolarizations();
 		void writeFeedEntries();
 		void writeBandInfo();
 		void writeAntennae();
@@ -42,17 +54,24 @@ class MSWriter : public Writer
 		void writeObservation();
 		void writeHistoryItem();
 		void initialize();
-		void flush();
+		void startSliceWriter();
+		void submitSlice();
+		void rethrowSliceWriteException();
+		void sliceWriteThreadFunc();
+		void writeSlice(struct MSWriterSlice& slice);
+		void growTable(size_t rowCount);
+		void writeConstantColumns(size_t row);
 		
 		std::unique_ptr<class MSWriterData> _data;
-		bool _isInitialized;
-		size_t _rowIndex, _sliceStart;
+		bool _isInitialized, _isFinished;
+		size_t _rowIndex;
 		
 		std::string _filename;
 		bool _useDysco;
 		
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
+		PolarizationMode _polarizationMode;
 		bool _flagPolarizationRow;
 		
 		struct {
@@ -69,7 +88,6 @@ class MSWriter : public Writer
 		ObservationInfo _observation;
 		std::string _historyCommandLine, _historyApplication;
 		std::vector<std::string> _historyParams;
-		bool _flushNeeded;
 };
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef PART_FILENAME_H
+#define PART_FILENAME_H
+
+#include <cstdio>
+#include <string>
+
+/**
+ * Name of a part of a split or sharded file, made by inserting the part index
+ * before the extension, e.g. "obs.ms" becomes "obs-part001.ms". Used both by
+ * afedit for split files and by aartfaac2ms for shards.
+ */
+inline std::string PartFilename(const std::string& filename, size_t partIndex)
+{
+	char partStr[16];
+	std::snprintf(partStr, sizeof partStr, "-part%03zu", partIndex);
+	
+	// Only look for an extension in the last path component
+	size_t slash = filename.rfind('/');
+	size_t dot = filename.rfind('.');
+	if(dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == 0)
+		return filename + partStr;
+	else
+		return filename.substr(0, dot) + partStr + filename.substr(dot);
+}
+
+#endif
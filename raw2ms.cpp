@@ -0,0 +1,141 @@
+#include "mswriter.h"
+#include "rawformat.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Converts a file in the raw columnar format (see rawformat.h) to a
+ * measurement set. The input is memory mapped and streamed into the
+ * measurement set writer.
+ */
+void convert(const char* inputFilename, const char* outputFilename, bool useDysco)
+{
+	int fd = open(inputFilename, O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error(std::string("Could not open ") + inputFilename + ": " + std::strerror(errno));
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+		throw std::runtime_error(std::string("Could not stat ") + inputFilename);
+	const size_t fileSize = st.st_size;
+	if(fileSize < sizeof(RawHeader))
+		throw std::runtime_error("Input file is too small to be a raw file");
+	void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED)
+		throw std::runtime_error(std::string("Could not map input file: ") + std::strerror(errno));
+	madvise(mapping, fileSize, MADV_SEQUENTIAL);
+	const char* file = reinterpret_cast<const char*>(mapping);
+	
+	RawHeader header;
+	std::memcpy(&header, file, sizeof(RawHeader));
+	if(std::memcmp(header.magic, RAW_FORMAT_MAGIC, sizeof(header.magic)) != 0)
+		throw std::runtime_error("Input file is not a raw file");
+	if(header.version != RAW_FORMAT_VERSION)
+		throw std::runtime_error("Unsupported version of raw file format");
+	Writer::PolarizationMode polarizationMode;
+	switch(header.nPolarizations)
+	{
+		case 4: polarizationMode = Writer::LinearPolarizations; break;
+		case 2: polarizationMode = Writer::DiagonalPolarizations; break;
+		case 1: polarizationMode = Writer::StokesIPolarization; break;
+		default: throw std::runtime_error("Unsupported number of polarizations in raw file");
+	}
+	if(header.metadataOffset + header.metadataSize > fileSize)
+		throw std::runtime_error("Input file is truncated");
+	
+	RawMetadata metadata;
+	metadata.Unserialize(file + header.metadataOffset, header.metadataSize);
+	
+	std::cout << "Converting " << header.nRows << " rows with " << header.nChannels << " channels and " << header.nAntennas << " antennas...\n";
+	
+	MSWriter writer(outputFilename);
+	if(useDysco)
+		writer.EnableCompression(8, 12, "TruncatedGaussian", 2.5, "AF");
+	writer.SetArrayLocation(metadata.arrayX, metadata.arrayY, metadata.arrayZ);
+	writer.WriteAntennae(metadata.antennae, metadata.antennaTime);
+	writer.WritePolarizations(polarizationMode, metadata.polarizationFlagRow);
+	writer.WriteBandInfo(metadata.bandName, metadata.channels, metadata.refFreq, metadata.totalBandwidth, metadata.bandFlagRow);
+	writer.WriteSource(metadata.source);
+	writer.WriteField(metadata.field);
+	writer.WriteObservation(metadata.observation);
+	if(metadata.hasHistory)
+		writer.WriteHistoryItem(metadata.historyCommandLine, metadata.historyApplication, metadata.historyParams);
+	writer.ReserveRows(header.nRows);
+	
+	const double
+		*times = reinterpret_cast<const double*>(file + header.columnOffsets[RawTimeColumn]),
+		*timeCentroids = reinterpret_cast<const double*>(file + header.columnOffsets[RawTimeCentroidColumn]),
+		*intervals = reinterpret_cast<const double*>(file + header.columnOffsets[RawIntervalColumn]),
+		*uvws = reinterpret_cast<const double*>(file + header.columnOffsets[RawUVWColumn]);
+	const uint32_t
+		*antenna1s = reinterpret_cast<const uint32_t*>(file + header.columnOffsets[RawAntenna1Column]),
+		*antenna2s = reinterpret_cast<const uint32_t*>(file + header.columnOffsets[RawAntenna2Column]);
+	const std::complex<float>* data = reinterpret_cast<const std::complex<float>*>(file + header.columnOffsets[RawDataColumn]);
+	const float* weights = reinterpret_cast<const float*>(file + header.columnOffsets[RawWeightColumn]);
+	// Flags are stored as bytes that are 0 or 1, which is the representation of bool
+	static_assert(sizeof(bool) == 1, "Flags are read as bools");
+	const bool* flags = reinterpret_cast<const bool*>(file + header.columnOffsets[RawFlagColumn]);
+	
+	const size_t nValues = header.nChannels * header.nPolarizations;
+	const size_t blockSize = header.nAntennas * (header.nAntennas + 1) / 2;
+	for(size_t blockStart = 0; blockStart < header.nRows; blockStart += blockSize)
+	{
+		const size_t blockEnd = std::min<size_t>(blockStart + blockSize, header.nRows);
+		writer.AddRows(blockEnd - blockStart);
+		for(size_t row = blockStart; row != blockEnd; ++row)
+		{
+			writer.WriteRow(times[row], timeCentroids[row], antenna1s[row], antenna2s[row],
+				uvws[row*3], uvws[row*3+1], uvws[row*3+2], intervals[row],
+				&data[row*nValues], &flags[row*nValues], &weights[row*nValues]);
+		}
+	}
+	writer.Finish();
+	
+	munmap(mapping, fileSize);
+}
+
+int main(int argc, char* argv[])
+{
+	int argi = 1;
+	bool useDysco = false;
+	while(argi < argc && argv[argi][0] == '-')
+	{
+		std::string p(&argv[argi][1]);
+		if(p == "use-dysco")
+		{
+			useDysco = true;
+		}
+		else {
+			std::cerr << "Invalid parameter -" << p << '\n';
+			return 1;
+		}
+		++argi;
+	}
+	if(argi+2 > argc)
+	{
+		std::cerr <<
+			"Syntax: raw2ms [options] <input.raw> <output.ms>\n"
+			"options:\n"
+			"  -use-dysco\n"
+			"\tCompress the measurement set with Dysco, using default settings.\n";
+		return 1;
+	}
+	try {
+		convert(argv[argi], argv[argi+1], useDysco);
+	} catch(std::exception& e) {
+		std::cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,237 @@
+#include "rawformat.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+	
+	class Serializer
+	{
+	public:
+		Serializer(std::vector<char>& buffer) : _buffer(buffer) { }
+		
+		void UInt(uint32_t value) { append(&value, sizeof value); }
+		void Bool(bool value) { UInt(value ? 1 : 0); }
+		void Int(int value) { UInt(uint32_t(value)); }
+		void Double(double value) { append(&value, sizeof value); }
+		void String(const std::string& str)
+		{
+			UInt(str.size());
+			append(str.data(), str.size());
+		}
+		
+	private:
+		void append(const void* data, size_t size)
+		{
+			const char* chars = reinterpret_cast<const char*>(data);
+			_buffer.insert(_buffer.end(), chars, chars + size);
+		}
+		
+		std::vector<char>& _buffer;
+	};
+	
+	class Unserializer
+	{
+	public:
+		Unserializer(const char* buffer, size_t size) : _position(buffer), _end(buffer + size) { }
+		
+		uint32_t UInt() { uint32_t value; read(&value, sizeof value); return value; }
+		bool Bool() { return UInt() != 0; }
+		int Int() { return int(UInt()); }
+		double Double() { double value; read(&value, sizeof value); return value; }
+		std::string String()
+		{
+			size_t size = UInt();
+			check(size);
+			std::string str(_position, size);
+			_position += size;
+			return str;
+		}
+		
+	private:
+		void check(size_t size) const
+		{
+			if(size_t(_end - _position) < size)
+				throw std::runtime_error("Metadata block of raw file is truncated");
+		}
+		
+		void read(void* data, size_t size)
+		{
+			check(size);
+			std::memcpy(data, _position, size);
+			_position += size;
+		}
+		
+		const char *_position, *_end;
+	};
+}
+
+RawMetadata::RawMetadata() :
+	refFreq(0.0), totalBandwidth(0.0), bandFlagRow(false),
+	antennaTime(0.0),
+	polarizationFlagRow(false),
+	source(), field(), observation(),
+	hasHistory(false),
+	arrayX(0.0), arrayY(0.0), arrayZ(0.0)
+{
+}
+
+void RawMetadata::Serialize(std::vector<char>& buffer) const
+{
+	Serializer s(buffer);
+	s.String(bandName);
+	s.UInt(channels.size());
+	for(const Writer::ChannelInfo& channel : channels)
+	{
+		s.Double(channel.chanFreq);
+		s.Double(channel.chanWidth);
+		s.Double(channel.effectiveBW);
+		s.Double(channel.resolution);
+	}
+	s.Double(refFreq);
+	s.Double(totalBandwidth);
+	s.Bool(bandFlagRow);
+	
+	s.UInt(antennae.size());
+	for(const Writer::AntennaInfo& antenna : antennae)
+	{
+		s.String(antenna.name);
+		s.String(antenna.station);
+		s.String(antenna.type);
+		s.String(antenna.mount);
+		s.Double(antenna.x);
+		s.Double(antenna.y);
+		s.Double(antenna.z);
+		s.Double(antenna.diameter);
+		s.Bool(antenna.flag);
+	}
+	s.Double(antennaTime);
+	
+	s.Bool(polarizationFlagRow);
+	
+	s.Int(source.sourceId);
+	s.Double(source.time);
+	s.Double(source.interval);
+	s.Int(source.spectralWindowId);
+	s.Int(source.numLines);
+	s.String(source.name);
+	s.Int(source.calibrationGroup);
+	s.String(source.code);
+	s.Double(source.directionRA);
+	s.Double(source.directionDec);
+	s.Double(source.properMotion[0]);
+	s.Double(source.properMotion[1]);
+	
+	s.String(field.name);
+	s.String(field.code);
+	s.Double(field.time);
+	s.Int(field.numPoly);
+	s.Double(field.delayDirRA);
+	s.Double(field.delayDirDec);
+	s.Double(field.phaseDirRA);
+	s.Double(field.phaseDirDec);
+	s.Double(field.referenceDirRA);
+	s.Double(field.referenceDirDec);
+	s.Int(field.sourceId);
+	s.Bool(field.flagRow);
+	
+	s.String(observation.telescopeName);
+	s.Double(observation.startTime);
+	s.Double(observation.endTime);
+	s.String(observation.observer);
+	s.String(observation.scheduleType);
+	s.String(observation.project);
+	s.Double(observation.releaseDate);
+	s.Bool(observation.flagRow);
+	
+	s.Bool(hasHistory);
+	s.String(historyCommandLine);
+	s.String(historyApplication);
+	s.UInt(historyParams.size());
+	for(const std::string& param : historyParams)
+		s.String(param);
+	
+	s.Double(arrayX);
+	s.Double(arrayY);
+	s.Double(arrayZ);
+}
+
+void RawMetadata::Unserialize(const char* buffer, size_t size)
+{
+	Unserializer u(buffer, size);
+	bandName = u.String();
+	channels.resize(u.UInt());
+	for(Writer::ChannelInfo& channel : channels)
+	{
+		channel.chanFreq = u.Double();
+		channel.chanWidth = u.Double();
+		channel.effectiveBW = u.Double();
+		channel.resolution = u.Double();
+	}
+	refFreq = u.Double();
+	totalBandwidth = u.Double();
+	bandFlagRow = u.Bool();
+	
+	antennae.resize(u.UInt());
+	for(Writer::AntennaInfo& antenna : antennae)
+	{
+		antenna.name = u.String();
+		antenna.station = u.String();
+		antenna.type = u.String();
+		antenna.mount = u.String();
+		antenna.x = u.Double();
+		antenna.y = u.Double();
+		antenna.z = u.Double();
+		antenna.diameter = u.Double();
+		antenna.flag = u.Bool();
+	}
+	antennaTime = u.Double();
+	
+	polarizationFlagRow = u.Bool();
+	
+	source.sourceId = u.Int();
+	source.time = u.Double();
+	source.interval = u.Double();
+	source.spectralWindowId = u.Int();
+	source.numLines = u.Int();
+	source.name = u.String();
+	source.calibrationGroup = u.Int();
+	source.code = u.String();
+	source.directionRA = u.Double();
+	source.directionDec = u.Double();
+	source.properMotion[0] = u.Double();
+	source.properMotion[1] = u.Double();
+	
+	field.name = u.String();
+	field.code = u.String();
+	field.time = u.Double();
+	field.numPoly = u.Int();
+	field.delayDirRA = u.Double();
+	field.delayDirDec = u.Double();
+	field.phaseDirRA = u.Double();
+	field.phaseDirDec = u.Double();
+	field.referenceDirRA = u.Double();
+	field.referenceDirDec = u.Double();
+	field.sourceId = u.Int();
+	field.flagRow = u.Bool();
+	
+	observation.telescopeName = u.String();
+	observation.startTime = u.Double();
+	observation.endTime = u.Double();
+	observation.observer = u.String();
+	observation.scheduleType = u.String();
+	observation.project = u.String();
+	observation.releaseDate = u.Double();
+	observation.flagRow = u.Bool();
+	
+	hasHistory = u.Bool();
+	historyCommandLine = u.String();
+	historyApplication = u.String();
+	historyParams.resize(u.UInt());
+	for(std::string& param : historyParams)
+		param = u.String();
+	
+	arrayX = u.Double();
+	arrayY = u.Double();
+	arrayZ = u.Double();
+}
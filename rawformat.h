@@ -0,0 +1,125 @@
+#ifndef RAW_FORMAT_H
+#define RAW_FORMAT_H
+
+#include "writer.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @file
+ * Definition of the raw columnar output format. It is written by RawWriter
+ * and can be turned into a measurement set with raw2ms. The format is meant
+ * to be written and read with plain (streaming) I/O, or to be memory mapped
+ * by monitoring tools.
+ *
+ * All values are stored in native (little-endian) byte order. A file consists
+ * of:
+ * - A RawHeader of 512 bytes at offset 0.
+ * - One array per column (see RawColumn), each starting at the offset given
+ *   in RawHeader::columnOffsets. Offsets are multiples of RawColumnAlignment.
+ *   Every column holds room for RawHeader::rowCapacity rows, of which the
+ *   first RawHeader::nRows are valid. Row r of a column starts at
+ *   columnOffset + r * RawColumnRowSize(column, header).
+ * - A metadata block at RawHeader::metadataOffset, see RawMetadata.
+ *
+ * The header is written last; a file of which RawHeader::nRows is zero
+ * was either empty or not properly closed.
+ */
+
+#define RAW_FORMAT_MAGIC "AF2MSRAW"
+#define RAW_FORMAT_VERSION 1
+
+enum RawColumn
+{
+	RawTimeColumn,         // double: time in MJD seconds
+	RawTimeCentroidColumn, // double: time centroid in MJD seconds
+	RawIntervalColumn,     // double: integration time in seconds
+	RawAntenna1Column,     // uint32_t
+	RawAntenna2Column,     // uint32_t
+	RawUVWColumn,          // 3 x double: u, v, w in metres
+	RawDataColumn,         // nChannels x nPolarizations x complex<float>
+	RawFlagColumn,         // nChannels x nPolarizations x uint8_t (0 or 1)
+	RawWeightColumn,       // nChannels x nPolarizations x float
+	RawColumnCount
+};
+
+const size_t RawColumnAlignment = 4096;
+
+struct RawHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nPolarizations;
+	uint32_t nChannels;
+	uint32_t nAntennas;
+	uint64_t nRows;
+	uint64_t rowCapacity;
+	uint64_t metadataOffset;
+	uint64_t metadataSize;
+	uint64_t columnOffsets[RawColumnCount];
+	char padding[384];
+};
+
+static_assert(sizeof(RawHeader) == 512, "RawHeader should be 512 bytes");
+
+inline size_t RawColumnRowSize(RawColumn column, size_t nChannels, size_t nPolarizations)
+{
+	switch(column)
+	{
+		case RawTimeColumn:
+		case RawTimeCentroidColumn:
+		case RawIntervalColumn:
+			return sizeof(double);
+		case RawAntenna1Column:
+		case RawAntenna2Column:
+			return sizeof(uint32_t);
+		case RawUVWColumn:
+			return 3 * sizeof(double);
+		case RawDataColumn:
+			return nChannels * nPolarizations * 2 * sizeof(float);
+		case RawFlagColumn:
+			return nChannels * nPolarizations;
+		case RawWeightColumn:
+			return nChannels * nPolarizations * sizeof(float);
+		default:
+			return 0;
+	}
+}
+
+/**
+ * The metadata that is passed to a Writer before the rows. In the file, it
+ * is stored as a sequence of fields in the order of the members below.
+ * Integers and booleans are stored as uint32_t, floating point values as
+ * double, strings as a uint32_t length followed by the characters, and
+ * vectors as a uint32_t element count followed by the elements.
+ */
+struct RawMetadata
+{
+	std::string bandName;
+	std::vector<Writer::ChannelInfo> channels;
+	double refFreq, totalBandwidth;
+	bool bandFlagRow;
+	
+	std::vector<Writer::AntennaInfo> antennae;
+	double antennaTime;
+	
+	bool polarizationFlagRow;
+	Writer::SourceInfo source;
+	Writer::FieldInfo field;
+	Writer::ObservationInfo observation;
+	
+	bool hasHistory;
+	std::string historyCommandLine, historyApplication;
+	std::vector<std::string> historyParams;
+	
+	double arrayX, arrayY, arrayZ;
+	
+	RawMetadata();
+	
+	void Serialize(std::vector<char>& buffer) const;
+	void Unserialize(const char* buffer, size_t size);
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "rawwriter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+RawWriter::RawWriter(const std::string& filename) :
+	_header(),
+	_polarizationMode(LinearPolarizations),
+	_columnsInitialized(false),
+	_isFinished(false),
+	_blockStart(0),
+	_nRowsWritten(0)
+{
+	_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(_fd < 0)
+		throw std::runtime_error("Could not create raw output file " + filename + ": " + std::strerror(errno));
+}
+
+RawWriter::~RawWriter()
+{
+	if(!_isFinished)
+	{
+		try {
+			Finish();
+		} catch(std::exception& e) {
+			std::cerr << "Error while finishing raw output file: " << e.what() << '\n';
+		}
+	}
+	if(_fd >= 0)
+		close(_fd);
+}
+
+void RawWriter::Finish()
+{
+	_isFinished = true;
+	if(!_columnsInitialized)
+		initializeColumns();
+	flushBlock();
+	
+	std::vector<char> metadataBuffer;
+	_metadata.Serialize(metadataBuffer);
+	_header.metadataSize = metadataBuffer.size();
+	writeAt(metadataBuffer.data(), metadataBuffer.size(), _header.metadataOffset);
+	
+	// The header is written last, so that an interrupted file is recognizable
+	_header.nRows = _nRowsWritten;
+	writeAt(&_header, sizeof(RawHeader), 0);
+	const int fd = _fd;
+	_fd = -1;
+	if(close(fd) != 0)
+		throw std::runtime_error(std::string("Error writing raw output file: ") + std::strerror(errno));
+}
+
+void RawWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	_metadata.bandName = name;
+	_metadata.channels = channels;
+	_metadata.refFreq = refFreq;
+	_metadata.totalBandwidth = totalBandwidth;
+	_metadata.bandFlagRow = flagRow;
+}
+
+void RawWriter::WriteAntennae(const std::vector<AntennaInfo>& antennae, double time)
+{
+	_metadata.antennae = antennae;
+	_metadata.antennaTime = time;
+}
+
+void RawWriter::WritePolarizations(PolarizationMode mode, bool flagRow)
+{
+	_polarizationMode = mode;
+	_metadata.polarizationFlagRow = flagRow;
+}
+
+void RawWriter::WriteField(const FieldInfo& field)
+{
+	_metadata.field = field;
+}
+
+void RawWriter::WriteSource(const SourceInfo &source)
+{
+	_metadata.source = source;
+}
+
+void RawWriter::WriteObservation(const ObservationInfo& observation)
+{
+	_metadata.observation = observation;
+}
+
+void RawWriter::WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params)
+{
+	_metadata.hasHistory = true;
+	_metadata.historyCommandLine = commandLine;
+	_metadata.historyApplication = application;
+	_metadata.historyParams = params;
+}
+
+void RawWriter::ReserveRows(size_t count)
+{
+	if(_columnsInitialized)
+		throw std::runtime_error("RawWriter::ReserveRows() should be called before AddRows()");
+	_header.rowCapacity = count;
+}
+
+void RawWriter::initializeColumns()
+{
+	std::memcpy(_header.magic, RAW_FORMAT_MAGIC, sizeof(_header.magic));
+	_header.version = RAW_FORMAT_VERSION;
+	_header.nPolarizations = nPolarizations();
+	_header.nChannels = _metadata.channels.size();
+	_header.nAntennas = _metadata.antennae.size();
+	_header.nRows = 0;
+	uint64_t offset = RawColumnAlignment;
+	for(size_t i=0; i!=RawColumnCount; ++i)
+	{
+		_header.columnOffsets[i] = offset;
+		uint64_t size = _header.rowCapacity * RawColumnRowSize(RawColumn(i), _header.nChannels, _header.nPolarizations);
+		offset += (size + RawColumnAlignment - 1) / RawColumnAlignment * RawColumnAlignment;
+	}
+	_header.metadataOffset = offset;
+	// Allocate the (sparse) file up front, so that it can be mapped while
+	// it is being written.
+	if(ftruncate(_fd, offset) != 0)
+		throw std::runtime_error(std::string("Could not resize raw output file: ") + std::strerror(errno));
+	_columnsInitialized = true;
+}
+
+void RawWriter::AddRows(size_t count)
+{
+	if(!_columnsInitialized)
+	{
+		if(_header.rowCapacity == 0)
+			throw std::runtime_error("RawWriter requires the number of rows to be set with ReserveRows()");
+		initializeColumns();
+	}
+	flushBlock();
+	
+	const size_t nValues = _header.nChannels * _header.nPolarizations;
+	_times.resize(count);
+	_timeCentroids.resize(count);
+	_intervals.resize(count);
+	_antenna1s.resize(count);
+	_antenna2s.resize(count);
+	_uvws.resize(count * 3);
+	_data.resize(count * nValues);
+	_flags.resize(count * nValues);
+	_weights.resize(count * nValues);
+}
+
+void RawWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	if(_nRowsWritten == _header.rowCapacity)
+		throw std::runtime_error("More rows were written to the raw output file than were reserved");
+	const size_t index = _nRowsWritten - _blockStart;
+	if(index == _times.size())
+		throw std::runtime_error("More rows were written than specified in RawWriter::AddRows()");
+	
+	_times[index] = time;
+	_timeCentroids[index] = timeCentroid;
+	_intervals[index] = interval;
+	_antenna1s[index] = antenna1;
+	_antenna2s[index] = antenna2;
+	_uvws[index*3] = u;
+	_uvws[index*3 + 1] = v;
+	_uvws[index*3 + 2] = w;
+	const size_t nValues = _header.nChannels * _header.nPolarizations;
+	std::copy_n(data, nValues, &_data[index * nValues]);
+	std::copy_n(weights, nValues, &_weights[index * nValues]);
+	uint8_t* flagPtr = &_flags[index * nValues];
+	for(size_t i=0; i!=nValues; ++i)
+		flagPtr[i] = flags[i] ? 1 : 0;
+	++_nRowsWritten;
+}
+
+void RawWriter::flushBlock()
+{
+	if(_nRowsWritten != _blockStart)
+	{
+		writeColumn(RawTimeColumn, _times.data());
+		writeColumn(RawTimeCentroidColumn, _timeCentroids.data());
+		writeColumn(RawIntervalColumn, _intervals.data());
+		writeColumn(RawAntenna1Column, _antenna1s.data());
+		writeColumn(RawAntenna2Column, _antenna2s.data());
+		writeColumn(RawUVWColumn, _uvws.data());
+		writeColumn(RawDataColumn, _data.data());
+		writeColumn(RawFlagColumn, _flags.data());
+		writeColumn(RawWeightColumn, _weights.data());
+		_blockStart = _nRowsWritten;
+	}
+}
+
+void RawWriter::writeColumn(RawColumn column, const void* data)
+{
+	const size_t rowSize = RawColumnRowSize(column, _header.nChannels, _header.nPolarizations);
+	writeAt(data, (_nRowsWritten - _blockStart) * rowSize, _header.columnOffsets[column] + _blockStart * rowSize);
+}
+
+void RawWriter::writeAt(const void* data, size_t size, uint64_t offset)
+{
+	const char* position = reinterpret_cast<const char*>(data);
+	while(size != 0)
+	{
+		ssize_t result = pwrite(_fd, position, size, offset);
+		if(result < 0)
+		{
+			if(errno != EINTR)
+				throw std::runtime_error(std::string("Error writing raw output file: ") + std::strerror(errno));
+		}
+		else {
+			position += result;
+			size -= result;
+			offset += result;
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef RAW_WRITER_H
+#define RAW_WRITER_H
+
+#include "rawformat.h"
+#include "writer.h"
+
+#include <aocommon/uvector.h>
+
+#include <complex>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Writes the raw columnar format that is described in rawformat.h. The
+ * columns are sized from the number of rows given to ReserveRows(), which
+ * should therefore be called before the first call to AddRows(). Each block
+ * of rows is written with one positioned write per column. The header is
+ * written by Finish(), so a file that was not finished is not valid.
+ */
+class RawWriter : public Writer
+{
+	public:
+		RawWriter(const std::string& filename);
+		virtual ~RawWriter() final override;
+		
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) final override;
+		virtual void WriteField(const FieldInfo& field) final override;
+		virtual void WriteSource(const SourceInfo &source) final override;
+		virtual void WriteObservation(const ObservationInfo& observation) final override;
+		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
+		virtual void SetArrayLocation(double x, double y, double z) final override
+		{
+			_metadata.arrayX = x;
+			_metadata.arrayY = y;
+			_metadata.arrayZ = z;
+		}
+		
+		virtual void ReserveRows(size_t count) final override;
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Finish() final override;
+		
+	private:
+		void initializeColumns();
+		void flushBlock();
+		void writeColumn(RawColumn column, const void* data);
+		void writeAt(const void* data, size_t size, uint64_t offset);
+		
+		size_t nPolarizations() const { return PolarizationCount(_polarizationMode); }
+		
+		int _fd;
+		RawMetadata _metadata;
+		RawHeader _header;
+		PolarizationMode _polarizationMode;
+		bool _columnsInitialized, _isFinished;
+		size_t _blockStart, _nRowsWritten;
+		
+		// Rows of the current block, stored per column
+		aocommon::UVector<double> _times, _timeCentroids, _intervals, _uvws;
+		aocommon::UVector<uint32_t> _antenna1s, _antenna2s;
+		aocommon::UVector<std::complex<float>> _data;
+		aocommon::UVector<uint8_t> _flags;
+		aocommon::UVector<float> _weights;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "shardedwriter.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+ShardedWriter::ShardedWriter(std::vector<std::unique_ptr<Writer>>&& shards) :
+	_shards(std::move(shards)),
+	_nBaselines(0)
+{
+	if(_shards.empty())
+		throw std::runtime_error("ShardedWriter needs at least one shard");
+}
+
+void ShardedWriter::WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
+}
+
+void ShardedWriter::WriteAntennae(const std::vector<Writer::AntennaInfo> &antennae, double time)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteAntennae(antennae, time);
+	
+	// Antenna1 a has (nAntennas - a) baselines
+	const size_t nAntennas = antennae.size();
+	std::vector<size_t> baselineCountPerAntenna1(nAntennas);
+	for(size_t antenna1=0; antenna1!=nAntennas; ++antenna1)
+		baselineCountPerAntenna1[antenna1] = nAntennas - antenna1;
+	assignShards(baselineCountPerAntenna1);
+}
+
+void ShardedWriter::SetBaselineSelection(const std::vector<std::pair<size_t, size_t>>& baselines)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->SetBaselineSelection(baselines);
+	
+	// Rebalance the shards for the selected baselines
+	std::vector<size_t> baselineCountPerAntenna1(_shardOfAntenna1.size(), 0);
+	for(const std::pair<size_t, size_t>& baseline : baselines)
+		++baselineCountPerAntenna1[baseline.first];
+	assignShards(baselineCountPerAntenna1);
+}
+
+void ShardedWriter::assignShards(const std::vector<size_t>& baselineCountPerAntenna1)
+{
+	// Assign each antenna1 to the shard that holds the baseline in the
+	// middle of its range.
+	_nBaselines = 0;
+	for(size_t count : baselineCountPerAntenna1)
+		_nBaselines += count;
+	_shardOfAntenna1.assign(baselineCountPerAntenna1.size(), 0);
+	_shardBaselineCount.assign(_shards.size(), 0);
+	size_t baselinesBefore = 0;
+	for(size_t antenna1=0; antenna1!=baselineCountPerAntenna1.size(); ++antenna1)
+	{
+		const size_t count = baselineCountPerAntenna1[antenna1];
+		const size_t middle = baselinesBefore + count/2;
+		const size_t shard = std::min(_shards.size()-1, middle * _shards.size() / std::max<size_t>(1, _nBaselines));
+		_shardOfAntenna1[antenna1] = shard;
+		_shardBaselineCount[shard] += count;
+		baselinesBefore += count;
+	}
+}
+
+void ShardedWriter::WritePolarizations(PolarizationMode mode, bool flagRow)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WritePolarizations(mode, flagRow);
+}
+
+void ShardedWriter::WriteSource(const Writer::SourceInfo &source)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteSource(source);
+}
+
+void ShardedWriter::WriteField(const Writer::FieldInfo& field)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteField(field);
+}
+
+void ShardedWriter::WriteObservation(const ObservationInfo& observation)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteObservation(observation);
+}
+
+void ShardedWriter::WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->WriteHistoryItem(commandLine, application, params);
+}
+
+void ShardedWriter::SetArrayLocation(double x, double y, double z)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->SetArrayLocation(x, y, z);
+}
+
+void ShardedWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->SetOffsetsPerGPUBox(offsets);
+}
+
+void ShardedWriter::ReserveRows(size_t rowCount)
+{
+	// Every baseline has the same number of rows in this case. This is
+	// rounded up, such that a shard never reserves too few rows.
+	if(_nBaselines != 0)
+	{
+		const size_t rowsPerBaseline = (rowCount + _nBaselines - 1) / _nBaselines;
+		for(size_t i=0; i!=_shards.size(); ++i)
+			_shards[i]->ReserveRows(rowsPerBaseline * _shardBaselineCount[i]);
+	}
+}
+
+void ShardedWriter::ReserveBaselineRows(const std::vector<BaselineRowCount>& rowCounts)
+{
+	std::vector<std::vector<BaselineRowCount>> shardRowCounts(_shards.size());
+	for(const BaselineRowCount& baseline : rowCounts)
+		shardRowCounts[_shardOfAntenna1[baseline.antenna1]].emplace_back(baseline);
+	for(size_t i=0; i!=_shards.size(); ++i)
+		_shards[i]->ReserveBaselineRows(shardRowCounts[i]);
+}
+
+void ShardedWriter::AddRows(size_t rowCount)
+{
+	// A block holds at most one row per baseline, so a shard never needs
+	// more rows than it has baselines.
+	for(size_t i=0; i!=_shards.size(); ++i)
+	{
+		if(_shardBaselineCount[i] != 0)
+			_shards[i]->AddRows(std::min(rowCount, _shardBaselineCount[i]));
+	}
+}
+
+void ShardedWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	_shards[_shardOfAntenna1[antenna1]]->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+}
+
+void ShardedWriter::Finish()
+{
+	for(std::unique_ptr<Writer>& shard : _shards)
+		shard->Finish();
+}
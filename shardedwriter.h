@@ -0,0 +1,66 @@
+#ifndef SHARDED_WRITER_H
+#define SHARDED_WRITER_H
+
+#include "writer.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Writes the rows to several independent writers (shards), split by
+ * baseline. Each shard receives a range of consecutive antenna1 values,
+ * chosen such that the shards hold about the same number of baselines.
+ * Metadata is written to all shards.
+ *
+ * This is normally used with a ThreadedWriter per shard, so that each shard
+ * writes its own output file from its own thread.
+ */
+class ShardedWriter : public Writer
+{
+	public:
+		ShardedWriter(std::vector<std::unique_ptr<Writer>>&& shards);
+		
+		virtual ~ShardedWriter() final override { }
+		
+		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<Writer::AntennaInfo> &antennae, double time) final override;
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) final override;
+		virtual void WriteSource(const Writer::SourceInfo &source) final override;
+		virtual void WriteField(const Writer::FieldInfo& field) final override;
+		virtual void WriteObservation(const ObservationInfo& observation) final override;
+		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
+		virtual void SetArrayLocation(double x, double y, double z) final override;
+		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets) final override;
+		
+		virtual void SetBaselineSelection(const std::vector<std::pair<size_t, size_t>>& baselines) final override;
+		virtual void ReserveRows(size_t rowCount) final override;
+		virtual void ReserveBaselineRows(const std::vector<BaselineRowCount>& rowCounts) final override;
+		virtual void AddRows(size_t rowCount) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void Finish() final override;
+		
+		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override
+		{
+			return _shards[_shardOfAntenna1[antenna1]]->IsTimeAligned(antenna1, antenna2);
+		}
+		
+		virtual bool AreAntennaPositionsLocal() const final override
+		{
+			return _shards.front()->AreAntennaPositionsLocal();
+		}
+		
+		virtual bool CanWriteStatistics() const final override
+		{
+			return _shards.front()->CanWriteStatistics();
+		}
+		
+	private:
+		void assignShards(const std::vector<size_t>& baselineCountPerAntenna1);
+		
+		std::vector<std::unique_ptr<Writer>> _shards;
+		std::vector<size_t> _shardOfAntenna1;
+		std::vector<size_t> _shardBaselineCount;
+		size_t _nBaselines;
+};
+
+#endif
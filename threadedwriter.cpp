@@ -7,6 +7,7 @@ ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter) :
 	_isWriterReady(false),
 	_isBufferReady(false),
 	_isFinishing(false),
+	_polarizationCount(4),
 	_bufferedData(0),
 	_bufferedFlags(0),
 	_bufferedWeights(0),
@@ -31,7 +32,7 @@ ThreadedWriter::~ThreadedWriter()
 
 void ThreadedWriter::WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
 {
-	_arraySize = channels.size() * 4;
+	_arraySize = channels.size() * _polarizationCount;
 	_bufferedData = new std::complex<float>[_arraySize];
 	_bufferedFlags = new bool[_arraySize];
 	_bufferedWeights = new float[_arraySize];
@@ -39,6 +40,26 @@ void ThreadedWriter::WriteBandInfo(const std::string &name, const std::vector<Wr
 	ForwardingWriter::WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
 }
 
+void ThreadedWriter::ReserveRows(size_t rowCount)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	
+	while(!_isWriterReady || _isBufferReady)
+		_bufferChangeCondition.wait(lock);
+	
+	ParentWriter().ReserveRows(rowCount);
+}
+
+void ThreadedWriter::ReserveBaselineRows(const std::vector<BaselineRowCount>& rowCounts)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	
+	while(!_isWriterReady || _isBufferReady)
+		_bufferChangeCondition.wait(lock);
+	
+	ParentWriter().ReserveBaselineRows(rowCounts);
+}
+
 void ThreadedWriter::AddRows(size_t rowCount)
 {
 	std::unique_lock<std::mutex> lock(_mutex);
@@ -75,6 +96,19 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 	_bufferChangeCondition.notify_all();
 }
 
+void ThreadedWriter::Finish()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		
+		// Wait until the last buffered row has been written
+		while(!_isWriterReady || _isBufferReady)
+			_bufferChangeCondition.wait(lock);
+	}
+	
+	ParentWriter().Finish();
+}
+
 void ThreadedWriter::writerThreadFunc()
 {
 	std::unique_lock<std::mutex> lock(_mutex);
@@ -17,18 +17,30 @@ class ThreadedWriter : public ForwardingWriter
 		
 		virtual ~ThreadedWriter() final override;
 		
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) final override
+		{
+			_polarizationCount = PolarizationCount(mode);
+			ForwardingWriter::WritePolarizations(mode, flagRow);
+		}
+		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		
+		virtual void ReserveRows(size_t rowCount) final override;
+		
+		virtual void ReserveBaselineRows(const std::vector<BaselineRowCount>& rowCounts) final override;
+		
 		virtual void AddRows(size_t rowCount) final override;
 		
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
+		virtual void Finish() final override;
+		
 	private:
 		std::condition_variable _bufferChangeCondition;
 		std::mutex _mutex;
 		bool _isWriterReady, _isBufferReady, _isFinishing;
 		
-		size_t _arraySize;
+		size_t _polarizationCount, _arraySize;
 		double _bufferedTime, _bufferedTimeCentroid;
 		size_t _bufferedAntenna1, _bufferedAntenna2;
 		double _bufferedU, _bufferedV, _bufferedW;
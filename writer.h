@@ -2,6 +2,7 @@
 #define WRITER_H
 
 #include <string>
+#include <utility>
 #include <vector>
 #include <complex>
 
@@ -17,6 +18,24 @@ class Writer
 			bool flag;
 		};
 		
+		/**
+		 * The correlations that are written. The data, flags and weights given
+		 * to WriteRow() hold PolarizationCount() values per channel, in the
+		 * order XX, XY, YX, YY (linear), XX, YY (diagonal) or I (Stokes I).
+		 */
+		enum PolarizationMode { LinearPolarizations, DiagonalPolarizations, StokesIPolarization };
+		
+		static size_t PolarizationCount(PolarizationMode mode)
+		{
+			switch(mode)
+			{
+				case DiagonalPolarizations: return 2;
+				case StokesIPolarization: return 1;
+				case LinearPolarizations:
+				default: return 4;
+			}
+		}
+		
 		struct ChannelInfo
 		{
 			double chanFreq, chanWidth, effectiveBW, resolution;
@@ -46,6 +65,12 @@ class Writer
 			bool flagRow;
 		};
 		
+		struct BaselineRowCount
+		{
+			size_t antenna1, antenna2;
+			size_t rowCount;
+		};
+		
 		struct ObservationInfo
 		{
 			std::string telescopeName;
@@ -65,14 +90,58 @@ class Writer
 		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) = 0;
 		virtual void WriteAntennae(const std::vector<AntennaInfo> &antennae, double time) = 0;
-		virtual void WritePolarizationForLinearPols(bool flagRow) = 0;
+		/**
+		 * Sets the written correlations. Writers that buffer rows size their
+		 * buffers from the polarization count, so this should be called before
+		 * WriteBandInfo().
+		 */
+		virtual void WritePolarizations(PolarizationMode mode, bool flagRow) = 0;
 		virtual void WriteSource(const SourceInfo& source) = 0;
 		virtual void WriteField(const FieldInfo& field) = 0;
 		virtual void WriteObservation(const ObservationInfo& observation) = 0;
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) = 0;
 		
+		/**
+		 * Announces that rows are only written for the given baselines, given as
+		 * (antenna1, antenna2) pairs with antenna1 <= antenna2. By default, rows
+		 * are written for all baselines. This is optional, and if called it
+		 * should be called after writing the metadata and before ReserveRows().
+		 */
+		virtual void SetBaselineSelection(const std::vector<std::pair<size_t, size_t>>& baselines) { }
+		/**
+		 * Announces the total number of rows that will be written, so that the
+		 * writer can allocate its output in one go instead of growing it for
+		 * every call to AddRows(). This is optional, and if called it should
+		 * be called before the first call to AddRows().
+		 */
+		virtual void ReserveRows(size_t count) { }
+		/**
+		 * Like ReserveRows(), but for when baselines do not all have the same
+		 * number of rows, e.g. with baseline-dependent averaging. Writers that
+		 * divide rows by baseline use this to reserve exactly; by default, the
+		 * sum is reserved.
+		 */
+		virtual void ReserveBaselineRows(const std::vector<BaselineRowCount>& rowCounts)
+		{
+			size_t count = 0;
+			for(const BaselineRowCount& baseline : rowCounts)
+				count += baseline.rowCount;
+			ReserveRows(count);
+		}
+		/**
+		 * Starts a new block of rows. The count is an upper bound: fewer rows
+		 * may be written before the next call to AddRows().
+		 */
 		virtual void AddRows(size_t count) = 0;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) = 0;
+		/**
+		 * Writes everything that is still buffered and completes the output.
+		 * Errors are reported by throwing, so this should be called after the
+		 * last row, before the writer is destroyed. Destructors do not throw:
+		 * a writer that was not finished tries to finish and only reports
+		 * errors.
+		 */
+		virtual void Finish() { }
 		
 		virtual bool AreAntennaPositionsLocal() const { return false; }
 		virtual bool CanWriteStatistics() const { return false; }